@@ -0,0 +1,533 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <pixman.h>
+
+#define LOG_MODULE "bench"
+#include "kernel.h"
+#include "log.h"
+#include "memfd.h"
+#include "render.h"
+#include "workers.h"
+
+/*
+ * Offscreen benchmark of the render path. Run with 'meson test --benchmark'
+ * or directly; each case runs for at least MIN_TIME_NS and MIN_ITERATIONS.
+ */
+
+#define MIN_TIME_NS 200000000ull
+#define MIN_ITERATIONS 20
+
+/* Largest per-channel difference allowed between the kernels and pixman */
+#define KERNEL_TOLERANCE 3
+
+static const struct {
+  const char *name;
+  int width;
+  int height;
+} resolutions[] = {
+    {"1080p", 1920, 1080},
+    {"4K", 3840, 2160},
+    {"8K", 7680, 4320},
+};
+
+static const int scales[] = {120, 240, 360};
+static const int radii[] = {30, 60, 120};
+
+#if defined(__GLIBC__)
+/*
+ * Count heap allocations by interposing malloc(). The renderer must not
+ * allocate per frame once the sprite cache is warm.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#else
+static const unsigned long allocations = 0;
+#define HAVE_ALLOC_COUNT 0
+#endif
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct result {
+  unsigned long iterations;
+  uint64_t elapsed_ns;
+  unsigned long allocations;
+  uint64_t pixels;
+};
+
+struct bench_case {
+  pixman_image_t *image;
+  int width;
+  int height;
+  int radius;
+  int scale120;
+
+  /* Halo center and box of the previous incremental frame */
+  int x;
+  int y;
+  bool has_halo;
+  pixman_box32_t halo;
+};
+
+typedef uint64_t (*frame_fn)(struct bench_case *c, unsigned long i);
+
+/* Dim the whole buffer and draw the halo, as for a buffer of age 0 */
+static uint64_t frame_full(struct bench_case *c, unsigned long i) {
+  const int r = scale_to_px(c->radius, c->scale120);
+  render_dim(c->image, 0, 0, c->width, c->height);
+  render_halo(c->image, c->width / 2, c->height / 2, c->radius, c->scale120);
+  return (uint64_t)c->width * c->height + 4ull * r * r;
+}
+
+/* Restore the previous halo box to dim and draw the halo moved a bit */
+static uint64_t frame_incremental(struct bench_case *c, unsigned long i) {
+  const int r = scale_to_px(c->radius, c->scale120);
+  uint64_t pixels = 0;
+
+  if (c->has_halo) {
+    const pixman_box32_t *b = &c->halo;
+    render_dim(c->image, b->x1, b->y1, b->x2 - b->x1, b->y2 - b->y1);
+    pixels += (uint64_t)(b->x2 - b->x1) * (b->y2 - b->y1);
+  }
+
+  /* Sweep diagonally, like a fast pointer */
+  c->x = (c->x + 17) % c->width;
+  c->y = (c->y + 11) % c->height;
+
+  render_halo(c->image, c->x, c->y, c->radius, c->scale120);
+  c->has_halo = render_halo_box(&c->halo, c->x, c->y, r, c->width, c->height);
+  return pixels + 4ull * r * r;
+}
+
+/* A full frame in bands of about 256 KiB, spread over the worker threads */
+#define BAND_BYTES (256 * 1024)
+
+static void band_run(void *data, size_t index) {
+  struct bench_case *c = data;
+  const int band = BAND_BYTES / (c->width * 4) + 1;
+  const int y2 = (int)(index + 1) * band;
+  const pixman_box32_t box = {0, (int)index * band, c->width,
+                              y2 < c->height ? y2 : c->height};
+  render_rect(c->image, &box, render_halo_sprite(c->radius, c->scale120),
+              c->width / 2, c->height / 2, true);
+}
+
+static uint64_t frame_bands(struct bench_case *c, unsigned long i) {
+  const int r = scale_to_px(c->radius, c->scale120);
+  const int band = BAND_BYTES / (c->width * 4) + 1;
+
+  // Rasterize the sprite up front; the bands only read it
+  pixman_image_t *sprite = render_halo_sprite(c->radius, c->scale120);
+  const size_t count = (c->height + band - 1) / band;
+  if (render_rect_threaded(c->image, sprite)) {
+    workers_run(&band_run, c, count);
+  } else {
+    for (size_t j = 0; j < count; j++)
+      band_run(c, j);
+  }
+  return (uint64_t)c->width * c->height + 4ull * r * r;
+}
+
+static bool keep_none(int scale120) { return false; }
+
+/* Rasterize the halo sprite with a cold cache */
+static uint64_t frame_sprite(struct bench_case *c, unsigned long i) {
+  const int r = scale_to_px(c->radius, c->scale120);
+  render_prune_sprites(&keep_none);
+  render_halo_sprite(c->radius, c->scale120);
+  return 4ull * r * r;
+}
+
+static struct result run(struct bench_case *c, frame_fn frame) {
+  struct result res = {0};
+
+  /* Warm up caches and the sprite */
+  frame(c, 0);
+
+  const unsigned long allocs_before = allocations;
+  const uint64_t start = now_ns();
+  uint64_t elapsed = 0;
+
+  do {
+    res.pixels += frame(c, res.iterations);
+    res.iterations++;
+    elapsed = now_ns() - start;
+  } while (elapsed < MIN_TIME_NS || res.iterations < MIN_ITERATIONS);
+
+  res.elapsed_ns = elapsed;
+  res.allocations = allocations - allocs_before;
+  return res;
+}
+
+static void report(const char *res_name, int scale120, int radius,
+                   const char *kind, const struct result *res) {
+  const double ns_per_frame = (double)res->elapsed_ns / res->iterations;
+  const double mpix_per_s = res->pixels * 1000. / res->elapsed_ns;
+
+  printf("%-6s %d.%02dx r=%-4d %-14s %12.0f %10.1f", res_name,
+         scale120 / 120, scale120 % 120 * 100 / 120, radius, kind,
+         ns_per_frame, mpix_per_s);
+  if (HAVE_ALLOC_COUNT)
+    printf(" %10.2f", (double)res->allocations / res->iterations);
+  else
+    printf(" %10s", "n/a");
+  printf("\n");
+}
+
+static const pixman_color_t dim_color = {0, 0, 0, 0xbfff};
+
+static void run_backend(struct bench_case *c, frame_fn frame, const char *kind,
+                        const char *res_name) {
+  /* pixman, then every supported kernel */
+  const enum kernel_isa best = kernel_selected();
+
+  for (int isa = -1; isa < KERNEL_ISA_COUNT; isa++) {
+    if (isa >= 0 && !kernel_select(isa))
+      continue;
+    render_use_pixman(isa < 0);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s/%s", kind,
+             isa < 0 ? "pixman" : kernel_isa_name(isa));
+
+    const struct result res = run(c, frame);
+    report(res_name, c->scale120, c->radius, name, &res);
+  }
+
+  render_use_pixman(false);
+  kernel_select(best);
+}
+
+/* The kernels against pixman, where they matter: 4K and 8K frames */
+static bool compare_kernels(void) {
+  printf("\n");
+
+  for (size_t i = 1; i < sizeof(resolutions) / sizeof(resolutions[0]); i++) {
+    const int width = resolutions[i].width;
+    const int height = resolutions[i].height;
+
+    pixman_image_t *image =
+        pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+    if (image == NULL) {
+      LOG_ERR("failed to allocate %dx%d image", width, height);
+      return false;
+    }
+
+    struct bench_case c = {
+        .image = image,
+        .width = width,
+        .height = height,
+        .radius = 60,
+        .scale120 = 240,
+    };
+    run_backend(&c, &frame_full, "full", resolutions[i].name);
+    run_backend(&c, &frame_sprite, "sprite", resolutions[i].name);
+
+    pixman_image_unref(image);
+  }
+
+  return true;
+}
+
+/* Full 8K frames with 1, 2, 4, ... threads */
+static bool compare_threads(void) {
+  const int width = 7680, height = 4320;
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  pixman_image_t *image =
+      pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+  if (image == NULL) {
+    LOG_ERR("failed to allocate %dx%d image", width, height);
+    return false;
+  }
+
+  printf("\n");
+  bool ok = true;
+  for (long n = 1; ok && n <= (cpus > 1 ? cpus : 1); n *= 2) {
+    if (!workers_init(n - 1)) {
+      ok = false;
+      break;
+    }
+
+    struct bench_case c = {
+        .image = image,
+        .width = width,
+        .height = height,
+        .radius = 60,
+        .scale120 = 240,
+    };
+
+    char name[32];
+    snprintf(name, sizeof(name), "bands/%ld", n);
+    const struct result res = run(&c, &frame_bands);
+    report("8K", c.scale120, c.radius, name, &res);
+
+    workers_fini();
+  }
+
+  pixman_image_unref(image);
+  return ok;
+}
+
+static long minor_faults(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+#define ALLOC_RUNS 5
+
+/*
+ * Allocate a buffer like a new SHM pool in mhalo and paint its first full
+ * frame, with and without prefaulting and huge pages. Page faults are
+ * counted separately for both steps.
+ */
+static bool compare_alloc(void) {
+  static const struct {
+    const char *name;
+    unsigned flags;
+  } modes[] = {
+      {"plain", 0},
+      {"prefault", MEMFD_PREFAULT},
+      {"hugetlb", MEMFD_HUGETLB | MEMFD_PREFAULT},
+  };
+
+  printf("\n%-6s %-10s %12s %10s %12s %10s\n", "res", "alloc", "alloc ns",
+         "faults", "frame ns", "faults");
+
+  for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++) {
+    const int width = resolutions[i].width;
+    const int height = resolutions[i].height;
+    const int stride = width * 4;
+    const size_t size = (size_t)stride * height;
+
+    for (size_t j = 0; j < sizeof(modes) / sizeof(modes[0]); j++) {
+      uint64_t alloc_ns = 0, frame_ns = 0;
+      long alloc_faults = 0, frame_faults = 0;
+      bool huge = true;
+
+      for (int run = 0; run < ALLOC_RUNS; run++) {
+        struct memfd_map map;
+        long faults = minor_faults();
+        uint64_t start = now_ns();
+
+        if (!memfd_map_create(&map, "mhalo-bench", size, modes[j].flags))
+          return false;
+        if (modes[j].flags & MEMFD_PREFAULT)
+          memfd_prefault(&map, map.mem, size);
+
+        alloc_ns += now_ns() - start;
+        alloc_faults += minor_faults() - faults;
+        huge = huge && map.huge;
+
+        pixman_image_t *image = pixman_image_create_bits_no_clear(
+            PIXMAN_x8r8g8b8, width, height, map.mem, stride);
+        if (image == NULL) {
+          LOG_ERR("failed to create %dx%d image", width, height);
+          memfd_map_destroy(&map);
+          return false;
+        }
+
+        faults = minor_faults();
+        start = now_ns();
+
+        render_dim(image, 0, 0, width, height);
+        render_halo(image, width / 2, height / 2, 60, 120);
+
+        frame_ns += now_ns() - start;
+        frame_faults += minor_faults() - faults;
+
+        pixman_image_unref(image);
+        memfd_map_destroy(&map);
+      }
+
+      if ((modes[j].flags & MEMFD_HUGETLB) && !huge) {
+        printf("%-6s %-10s %12s\n", resolutions[i].name, modes[j].name,
+               "no huge pages");
+        continue;
+      }
+
+      printf("%-6s %-10s %12" PRIu64 " %10ld %12" PRIu64 " %10ld\n",
+             resolutions[i].name, modes[j].name, alloc_ns / ALLOC_RUNS,
+             alloc_faults / ALLOC_RUNS, frame_ns / ALLOC_RUNS,
+             frame_faults / ALLOC_RUNS);
+    }
+  }
+
+  return true;
+}
+
+static int max_channel_diff(pixman_image_t *a, pixman_image_t *b) {
+  const int width = pixman_image_get_width(a);
+  const int height = pixman_image_get_height(a);
+  const int stride_a = pixman_image_get_stride(a) / sizeof(uint32_t);
+  const int stride_b = pixman_image_get_stride(b) / sizeof(uint32_t);
+  const uint32_t *pa = pixman_image_get_data(a);
+  const uint32_t *pb = pixman_image_get_data(b);
+
+  int max = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const uint32_t va = pa[y * stride_a + x];
+      const uint32_t vb = pb[y * stride_b + x];
+      for (int shift = 0; shift < 32; shift += 8) {
+        const int d = abs((int)((va >> shift) & 0xff) - (int)((vb >> shift) & 0xff));
+        if (d > max)
+          max = d;
+      }
+    }
+  }
+  return max;
+}
+
+static bool keep_none(int scale120);
+
+/* Check every kernel the CPU supports against the pixman path */
+static bool check_kernels(void) {
+  const enum kernel_isa best = kernel_selected();
+  bool ok = true;
+
+  for (int isa = 0; isa < KERNEL_ISA_COUNT; isa++) {
+    if (!kernel_select(isa))
+      continue;
+
+    int max = 0;
+    for (size_t j = 0; j < sizeof(scales) / sizeof(scales[0]); j++) {
+      for (size_t k = 0; k < sizeof(radii) / sizeof(radii[0]); k++) {
+        render_prune_sprites(&keep_none);
+        render_use_pixman(true);
+        pixman_image_t *ref = render_halo_sprite(radii[k], scales[j]);
+        if (ref == NULL)
+          return false;
+        pixman_image_ref(ref);
+
+        render_prune_sprites(&keep_none);
+        render_use_pixman(false);
+        pixman_image_t *pix = render_halo_sprite(radii[k], scales[j]);
+        if (pix == NULL) {
+          pixman_image_unref(ref);
+          return false;
+        }
+
+        const int d = max_channel_diff(ref, pix);
+        max = d > max ? d : max;
+        pixman_image_unref(ref);
+      }
+    }
+
+    printf("kernel %-6s: max difference to pixman %d\n", kernel_isa_name(isa),
+           max);
+    if (max > KERNEL_TOLERANCE) {
+      LOG_ERR("%s: halo differs from pixman by %d (tolerance %d)",
+              kernel_isa_name(isa), max, KERNEL_TOLERANCE);
+      ok = false;
+    }
+  }
+
+  render_prune_sprites(&keep_none);
+  kernel_select(best);
+  return ok;
+}
+
+int main(int argc, char *const *argv) {
+  log_init(LOG_COLORIZE_AUTO, false, LOG_FACILITY_USER, LOG_CLASS_WARNING);
+
+  if (!render_init(&dim_color)) {
+    LOG_ERR("failed to initialize the renderer");
+    return EXIT_FAILURE;
+  }
+
+  int exit_code = EXIT_FAILURE;
+
+  if (!check_kernels())
+    goto out;
+  printf("\n");
+
+  printf("%-6s %5s  %-6s %-14s %12s %10s %10s\n", "res", "scale", "radius",
+         "case", "ns/frame", "Mpix/s", "allocs");
+
+  for (size_t i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++) {
+    for (size_t j = 0; j < sizeof(scales) / sizeof(scales[0]); j++) {
+      /* Resolutions are physical; the scale only affects the halo size */
+      const int width = resolutions[i].width;
+      const int height = resolutions[i].height;
+
+      pixman_image_t *image =
+          pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+      if (image == NULL) {
+        LOG_ERR("failed to allocate %dx%d image", width, height);
+        goto out;
+      }
+
+      for (size_t k = 0; k < sizeof(radii) / sizeof(radii[0]); k++) {
+        struct bench_case c = {
+            .image = image,
+            .width = width,
+            .height = height,
+            .radius = radii[k],
+            .scale120 = scales[j],
+        };
+
+        struct result res;
+
+        res = run(&c, &frame_full);
+        report(resolutions[i].name, c.scale120, c.radius, "full", &res);
+
+        render_dim(image, 0, 0, width, height);
+        res = run(&c, &frame_incremental);
+        report(resolutions[i].name, c.scale120, c.radius, "incremental", &res);
+
+        res = run(&c, &frame_sprite);
+        report(resolutions[i].name, c.scale120, c.radius, "sprite", &res);
+      }
+
+      pixman_image_unref(image);
+    }
+  }
+
+  if (!compare_kernels())
+    goto out;
+
+  if (!compare_threads())
+    goto out;
+
+  if (!compare_alloc())
+    goto out;
+
+  exit_code = EXIT_SUCCESS;
+
+out:
+  render_fini();
+  log_deinit();
+  return exit_code;
+}
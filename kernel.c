@@ -0,0 +1,526 @@
+#include "kernel.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86 1
+#else
+#define KERNEL_X86 0
+#endif
+
+#define LOG_MODULE "kernel"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+enum { CH_A, CH_R, CH_G, CH_B, CH_COUNT };
+
+/*
+ * A gradient as linear segments: from offset[k] up to offset[k + 1], each
+ * channel is base[k] + (t - offset[k]) * slope[k].
+ */
+struct ramp {
+  int count;
+  float start;
+  float end;
+  float offset[KERNEL_MAX_STOPS];
+  float base[KERNEL_MAX_STOPS][CH_COUNT];
+  float slope[KERNEL_MAX_STOPS][CH_COUNT];
+};
+
+struct halo {
+  float r;
+  float inv_r;
+  float dim[CH_COUNT];
+  struct ramp cut;
+  struct ramp glow;
+};
+
+static void ramp_init(struct ramp *ramp, const struct kernel_gradient *g) {
+  const size_t n = g->count < KERNEL_MAX_STOPS ? g->count : KERNEL_MAX_STOPS;
+
+  *ramp = (struct ramp){.count = 1};
+  if (n == 0)
+    return;
+
+  ramp->start = g->stops[0].offset;
+  ramp->end = g->stops[n - 1].offset;
+  ramp->count = n > 1 ? n - 1 : 1;
+
+  for (int k = 0; k < ramp->count; k++) {
+    const struct kernel_stop *s0 = &g->stops[k];
+    const struct kernel_stop *s1 = &g->stops[n > 1 ? k + 1 : k];
+    const float c0[CH_COUNT] = {s0->a, s0->r, s0->g, s0->b};
+    const float c1[CH_COUNT] = {s1->a, s1->r, s1->g, s1->b};
+    const float span = s1->offset - s0->offset;
+
+    ramp->offset[k] = s0->offset;
+    for (int c = 0; c < CH_COUNT; c++) {
+      ramp->base[k][c] = c0[c];
+      ramp->slope[k][c] = span > 0 ? (c1[c] - c0[c]) / span : 0;
+    }
+  }
+}
+
+static float channel_to_float(uint32_t pixel, int c) {
+  return ((pixel >> (24 - 8 * c)) & 0xff) / 255.f;
+}
+
+/* Scalar */
+
+static void ramp_eval(const struct ramp *ramp, float t, float v[CH_COUNT]) {
+  t = t < ramp->start ? ramp->start : t > ramp->end ? ramp->end : t;
+
+  int k = 0;
+  while (k + 1 < ramp->count && t >= ramp->offset[k + 1])
+    k++;
+
+  for (int c = 0; c < CH_COUNT; c++)
+    v[c] = ramp->base[k][c] + (t - ramp->offset[k]) * ramp->slope[k][c];
+}
+
+static uint32_t halo_pixel(const struct halo *h, float dx, float dy) {
+  const float t = sqrtf(dx * dx + dy * dy) * h->inv_r;
+
+  // Beyond the outer circle both gradients are transparent (REPEAT_NONE)
+  float cut[CH_COUNT] = {0}, glow[CH_COUNT] = {0};
+  if (t <= 1.f) {
+    ramp_eval(&h->cut, t, cut);
+    ramp_eval(&h->glow, t, glow);
+  }
+
+  // dim OUT_REVERSE cut, then glow OVER that; the glow is premultiplied here
+  const float f = (1.f - cut[CH_A]) * (1.f - glow[CH_A]);
+  uint32_t pixel = 0;
+  for (int c = 0; c < CH_COUNT; c++) {
+    const float g = c == CH_A ? glow[CH_A] : glow[c] * glow[CH_A];
+    const float o = g + h->dim[c] * f;
+    pixel |= (uint32_t)(o * 255.f + .5f) << (24 - 8 * c);
+  }
+  return pixel;
+}
+
+static void halo_scalar(uint32_t *dst, size_t stride, int size,
+                        const struct halo *h) {
+  for (int y = 0; y < size; y++) {
+    const float dy = y + .5f - h->r;
+    for (int x = 0; x < size; x++)
+      dst[y * stride + x] = halo_pixel(h, x + .5f - h->r, dy);
+  }
+}
+
+static void fill_scalar(uint32_t *dst, size_t stride, int width, int height,
+                        uint32_t pixel, bool nt) {
+  for (int y = 0; y < height; y++) {
+    uint32_t *row = dst + y * stride;
+    for (int x = 0; x < width; x++)
+      row[x] = pixel;
+  }
+}
+
+#if KERNEL_X86
+
+/* SSE2 */
+
+__attribute__((target("sse2"))) static void
+ramp_eval_sse2(const struct ramp *ramp, __m128 t, __m128 v[CH_COUNT]) {
+  t = _mm_min_ps(_mm_max_ps(t, _mm_set1_ps(ramp->start)),
+                 _mm_set1_ps(ramp->end));
+
+  __m128 d = _mm_sub_ps(t, _mm_set1_ps(ramp->offset[0]));
+  for (int c = 0; c < CH_COUNT; c++)
+    v[c] = _mm_add_ps(_mm_set1_ps(ramp->base[0][c]),
+                      _mm_mul_ps(d, _mm_set1_ps(ramp->slope[0][c])));
+
+  for (int k = 1; k < ramp->count; k++) {
+    const __m128 off = _mm_set1_ps(ramp->offset[k]);
+    const __m128 m = _mm_cmpge_ps(t, off);
+    d = _mm_sub_ps(t, off);
+    for (int c = 0; c < CH_COUNT; c++) {
+      const __m128 l = _mm_add_ps(_mm_set1_ps(ramp->base[k][c]),
+                                  _mm_mul_ps(d, _mm_set1_ps(ramp->slope[k][c])));
+      v[c] = _mm_or_ps(_mm_and_ps(m, l), _mm_andnot_ps(m, v[c]));
+    }
+  }
+}
+
+__attribute__((target("sse2"))) static void
+halo_sse2(uint32_t *dst, size_t stride, int size, const struct halo *h) {
+  const __m128 lane = _mm_setr_ps(.5f, 1.5f, 2.5f, 3.5f);
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 k255 = _mm_set1_ps(255.f);
+  const __m128 half = _mm_set1_ps(.5f);
+  const __m128 inv_r = _mm_set1_ps(h->inv_r);
+
+  __m128 dim[CH_COUNT];
+  for (int c = 0; c < CH_COUNT; c++)
+    dim[c] = _mm_set1_ps(h->dim[c]);
+
+  for (int y = 0; y < size; y++) {
+    uint32_t *row = dst + y * stride;
+    const float dy = y + .5f - h->r;
+    const __m128 dy2 = _mm_set1_ps(dy * dy);
+
+    int x = 0;
+    for (; x + 4 <= size; x += 4) {
+      const __m128 dx =
+          _mm_add_ps(_mm_set1_ps(x - h->r), lane);
+      const __m128 t = _mm_mul_ps(
+          _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), dy2)), inv_r);
+      const __m128 outside = _mm_cmpgt_ps(t, one);
+
+      __m128 cut[CH_COUNT], glow[CH_COUNT];
+      ramp_eval_sse2(&h->cut, t, cut);
+      ramp_eval_sse2(&h->glow, t, glow);
+
+      const __m128 ca = _mm_andnot_ps(outside, cut[CH_A]);
+      const __m128 ga = _mm_andnot_ps(outside, glow[CH_A]);
+      const __m128 f =
+          _mm_mul_ps(_mm_sub_ps(one, ca), _mm_sub_ps(one, ga));
+
+      __m128i px = _mm_setzero_si128();
+      for (int c = 0; c < CH_COUNT; c++) {
+        const __m128 g =
+            c == CH_A ? ga : _mm_mul_ps(_mm_andnot_ps(outside, glow[c]), ga);
+        const __m128 o = _mm_add_ps(g, _mm_mul_ps(dim[c], f));
+        const __m128i i = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(o, k255), half));
+        px = _mm_or_si128(px, _mm_slli_epi32(i, 24 - 8 * c));
+      }
+      _mm_storeu_si128((__m128i *)(row + x), px);
+    }
+
+    for (; x < size; x++)
+      row[x] = halo_pixel(h, x + .5f - h->r, dy);
+  }
+}
+
+__attribute__((target("sse2"))) static void
+fill_sse2(uint32_t *dst, size_t stride, int width, int height, uint32_t pixel,
+          bool nt) {
+  const __m128i v = _mm_set1_epi32((int)pixel);
+
+  for (int y = 0; y < height; y++) {
+    uint32_t *p = dst + y * stride;
+    uint32_t *const end = p + width;
+
+    while (p < end && ((uintptr_t)p & 15) != 0)
+      *p++ = pixel;
+    if (nt) {
+      for (; p + 4 <= end; p += 4)
+        _mm_stream_si128((__m128i *)p, v);
+    } else {
+      for (; p + 4 <= end; p += 4)
+        _mm_store_si128((__m128i *)p, v);
+    }
+    while (p < end)
+      *p++ = pixel;
+  }
+
+  if (nt)
+    _mm_sfence();
+}
+
+/* AVX2 */
+
+__attribute__((target("avx2"))) static void
+ramp_eval_avx2(const struct ramp *ramp, __m256 t, __m256 v[CH_COUNT]) {
+  t = _mm256_min_ps(_mm256_max_ps(t, _mm256_set1_ps(ramp->start)),
+                    _mm256_set1_ps(ramp->end));
+
+  __m256 d = _mm256_sub_ps(t, _mm256_set1_ps(ramp->offset[0]));
+  for (int c = 0; c < CH_COUNT; c++)
+    v[c] = _mm256_add_ps(_mm256_set1_ps(ramp->base[0][c]),
+                         _mm256_mul_ps(d, _mm256_set1_ps(ramp->slope[0][c])));
+
+  for (int k = 1; k < ramp->count; k++) {
+    const __m256 off = _mm256_set1_ps(ramp->offset[k]);
+    const __m256 m = _mm256_cmp_ps(t, off, _CMP_GE_OQ);
+    d = _mm256_sub_ps(t, off);
+    for (int c = 0; c < CH_COUNT; c++) {
+      const __m256 l =
+          _mm256_add_ps(_mm256_set1_ps(ramp->base[k][c]),
+                        _mm256_mul_ps(d, _mm256_set1_ps(ramp->slope[k][c])));
+      v[c] = _mm256_blendv_ps(v[c], l, m);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void
+halo_avx2(uint32_t *dst, size_t stride, int size, const struct halo *h) {
+  const __m256 lane =
+      _mm256_setr_ps(.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 k255 = _mm256_set1_ps(255.f);
+  const __m256 half = _mm256_set1_ps(.5f);
+  const __m256 inv_r = _mm256_set1_ps(h->inv_r);
+
+  __m256 dim[CH_COUNT];
+  for (int c = 0; c < CH_COUNT; c++)
+    dim[c] = _mm256_set1_ps(h->dim[c]);
+
+  for (int y = 0; y < size; y++) {
+    uint32_t *row = dst + y * stride;
+    const float dy = y + .5f - h->r;
+    const __m256 dy2 = _mm256_set1_ps(dy * dy);
+
+    int x = 0;
+    for (; x + 8 <= size; x += 8) {
+      const __m256 dx = _mm256_add_ps(_mm256_set1_ps(x - h->r), lane);
+      const __m256 t = _mm256_mul_ps(
+          _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), dy2)), inv_r);
+      const __m256 outside = _mm256_cmp_ps(t, one, _CMP_GT_OQ);
+
+      __m256 cut[CH_COUNT], glow[CH_COUNT];
+      ramp_eval_avx2(&h->cut, t, cut);
+      ramp_eval_avx2(&h->glow, t, glow);
+
+      const __m256 ca = _mm256_blendv_ps(cut[CH_A], zero, outside);
+      const __m256 ga = _mm256_blendv_ps(glow[CH_A], zero, outside);
+      const __m256 f =
+          _mm256_mul_ps(_mm256_sub_ps(one, ca), _mm256_sub_ps(one, ga));
+
+      __m256i px = _mm256_setzero_si256();
+      for (int c = 0; c < CH_COUNT; c++) {
+        const __m256 g =
+            c == CH_A ? ga
+                      : _mm256_mul_ps(_mm256_blendv_ps(glow[c], zero, outside),
+                                      ga);
+        const __m256 o = _mm256_add_ps(g, _mm256_mul_ps(dim[c], f));
+        const __m256i i =
+            _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(o, k255), half));
+        px = _mm256_or_si256(px, _mm256_slli_epi32(i, 24 - 8 * c));
+      }
+      _mm256_storeu_si256((__m256i *)(row + x), px);
+    }
+
+    for (; x < size; x++)
+      row[x] = halo_pixel(h, x + .5f - h->r, dy);
+  }
+}
+
+__attribute__((target("avx2"))) static void
+fill_avx2(uint32_t *dst, size_t stride, int width, int height, uint32_t pixel,
+          bool nt) {
+  const __m256i v = _mm256_set1_epi32((int)pixel);
+
+  for (int y = 0; y < height; y++) {
+    uint32_t *p = dst + y * stride;
+    uint32_t *const end = p + width;
+
+    while (p < end && ((uintptr_t)p & 31) != 0)
+      *p++ = pixel;
+    if (nt) {
+      for (; p + 8 <= end; p += 8)
+        _mm256_stream_si256((__m256i *)p, v);
+    } else {
+      for (; p + 8 <= end; p += 8)
+        _mm256_store_si256((__m256i *)p, v);
+    }
+    while (p < end)
+      *p++ = pixel;
+  }
+
+  if (nt)
+    _mm_sfence();
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512f"))) static void
+ramp_eval_avx512(const struct ramp *ramp, __m512 t, __m512 v[CH_COUNT]) {
+  t = _mm512_min_ps(_mm512_max_ps(t, _mm512_set1_ps(ramp->start)),
+                    _mm512_set1_ps(ramp->end));
+
+  __m512 d = _mm512_sub_ps(t, _mm512_set1_ps(ramp->offset[0]));
+  for (int c = 0; c < CH_COUNT; c++)
+    v[c] = _mm512_add_ps(_mm512_set1_ps(ramp->base[0][c]),
+                         _mm512_mul_ps(d, _mm512_set1_ps(ramp->slope[0][c])));
+
+  for (int k = 1; k < ramp->count; k++) {
+    const __m512 off = _mm512_set1_ps(ramp->offset[k]);
+    const __mmask16 m = _mm512_cmp_ps_mask(t, off, _CMP_GE_OQ);
+    d = _mm512_sub_ps(t, off);
+    for (int c = 0; c < CH_COUNT; c++) {
+      const __m512 l =
+          _mm512_add_ps(_mm512_set1_ps(ramp->base[k][c]),
+                        _mm512_mul_ps(d, _mm512_set1_ps(ramp->slope[k][c])));
+      v[c] = _mm512_mask_blend_ps(m, v[c], l);
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+halo_avx512(uint32_t *dst, size_t stride, int size, const struct halo *h) {
+  const __m512 lane =
+      _mm512_setr_ps(.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f, 8.5f,
+                     9.5f, 10.5f, 11.5f, 12.5f, 13.5f, 14.5f, 15.5f);
+  const __m512 one = _mm512_set1_ps(1.f);
+  const __m512 k255 = _mm512_set1_ps(255.f);
+  const __m512 half = _mm512_set1_ps(.5f);
+  const __m512 inv_r = _mm512_set1_ps(h->inv_r);
+
+  __m512 dim[CH_COUNT];
+  for (int c = 0; c < CH_COUNT; c++)
+    dim[c] = _mm512_set1_ps(h->dim[c]);
+
+  for (int y = 0; y < size; y++) {
+    uint32_t *row = dst + y * stride;
+    const float dy = y + .5f - h->r;
+    const __m512 dy2 = _mm512_set1_ps(dy * dy);
+
+    // The tail is handled with a masked store instead of scalar code
+    for (int x = 0; x < size; x += 16) {
+      const __mmask16 store =
+          size - x >= 16 ? 0xffff : (__mmask16)((1u << (size - x)) - 1);
+
+      const __m512 dx = _mm512_add_ps(_mm512_set1_ps(x - h->r), lane);
+      const __m512 t = _mm512_mul_ps(
+          _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), dy2)), inv_r);
+      const __mmask16 inside = _mm512_cmp_ps_mask(t, one, _CMP_LE_OQ);
+
+      __m512 cut[CH_COUNT], glow[CH_COUNT];
+      ramp_eval_avx512(&h->cut, t, cut);
+      ramp_eval_avx512(&h->glow, t, glow);
+
+      const __m512 ca = _mm512_maskz_mov_ps(inside, cut[CH_A]);
+      const __m512 ga = _mm512_maskz_mov_ps(inside, glow[CH_A]);
+      const __m512 f =
+          _mm512_mul_ps(_mm512_sub_ps(one, ca), _mm512_sub_ps(one, ga));
+
+      __m512i px = _mm512_setzero_si512();
+      for (int c = 0; c < CH_COUNT; c++) {
+        const __m512 g =
+            c == CH_A
+                ? ga
+                : _mm512_mul_ps(_mm512_maskz_mov_ps(inside, glow[c]), ga);
+        const __m512 o = _mm512_add_ps(g, _mm512_mul_ps(dim[c], f));
+        const __m512i i =
+            _mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(o, k255), half));
+        px = _mm512_or_si512(px, _mm512_slli_epi32(i, 24 - 8 * c));
+      }
+      _mm512_mask_storeu_epi32(row + x, store, px);
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) static void
+fill_avx512(uint32_t *dst, size_t stride, int width, int height,
+            uint32_t pixel, bool nt) {
+  const __m512i v = _mm512_set1_epi32((int)pixel);
+
+  for (int y = 0; y < height; y++) {
+    uint32_t *p = dst + y * stride;
+    uint32_t *const end = p + width;
+
+    while (p < end && ((uintptr_t)p & 63) != 0)
+      *p++ = pixel;
+    if (nt) {
+      for (; p + 16 <= end; p += 16)
+        _mm512_stream_si512((void *)p, v);
+    } else {
+      for (; p + 16 <= end; p += 16)
+        _mm512_store_si512((void *)p, v);
+    }
+    while (p < end)
+      *p++ = pixel;
+  }
+
+  if (nt)
+    _mm_sfence();
+}
+
+#endif /* KERNEL_X86 */
+
+typedef void (*fill_fn)(uint32_t *dst, size_t stride, int width, int height,
+                        uint32_t pixel, bool nt);
+typedef void (*halo_fn)(uint32_t *dst, size_t stride, int size,
+                        const struct halo *h);
+
+static const struct {
+  const char *name;
+  fill_fn fill;
+  halo_fn halo;
+} kernels[KERNEL_ISA_COUNT] = {
+    [KERNEL_SCALAR] = {"scalar", &fill_scalar, &halo_scalar},
+#if KERNEL_X86
+    [KERNEL_SSE2] = {"sse2", &fill_sse2, &halo_sse2},
+    [KERNEL_AVX2] = {"avx2", &fill_avx2, &halo_avx2},
+    [KERNEL_AVX512] = {"avx512", &fill_avx512, &halo_avx512},
+#else
+    [KERNEL_SSE2] = {"sse2", NULL, NULL},
+    [KERNEL_AVX2] = {"avx2", NULL, NULL},
+    [KERNEL_AVX512] = {"avx512", NULL, NULL},
+#endif
+};
+
+static enum kernel_isa selected = KERNEL_SCALAR;
+
+bool kernel_isa_supported(enum kernel_isa isa) {
+  switch (isa) {
+  case KERNEL_SCALAR:
+    return true;
+#if KERNEL_X86
+  case KERNEL_SSE2:
+    return __builtin_cpu_supports("sse2");
+  case KERNEL_AVX2:
+    return __builtin_cpu_supports("avx2");
+  case KERNEL_AVX512:
+    return __builtin_cpu_supports("avx512f");
+#endif
+  default:
+    return false;
+  }
+}
+
+const char *kernel_isa_name(enum kernel_isa isa) {
+  return isa < KERNEL_ISA_COUNT ? kernels[isa].name : "unknown";
+}
+
+bool kernel_select(enum kernel_isa isa) {
+  if (isa >= KERNEL_ISA_COUNT || !kernel_isa_supported(isa))
+    return false;
+
+  selected = isa;
+  return true;
+}
+
+enum kernel_isa kernel_selected(void) { return selected; }
+
+void kernel_init(void) {
+#if KERNEL_X86
+  __builtin_cpu_init();
+#endif
+
+  for (int isa = KERNEL_ISA_COUNT - 1; isa >= 0; isa--) {
+    if (kernel_select(isa))
+      break;
+  }
+  LOG_DBG("using %s kernels", kernel_isa_name(selected));
+}
+
+void kernel_fill(uint32_t *dst, size_t stride, int width, int height,
+                 uint32_t pixel, bool stream) {
+  if (width <= 0 || height <= 0)
+    return;
+
+  kernels[selected].fill(dst, stride, width, height, pixel, stream);
+}
+
+void kernel_halo(uint32_t *dst, size_t stride, int radius, uint32_t dim,
+                 const struct kernel_gradient *cut,
+                 const struct kernel_gradient *glow) {
+  if (radius <= 0)
+    return;
+
+  struct halo h = {
+      .r = radius,
+      .inv_r = 1.f / radius,
+  };
+  for (int c = 0; c < CH_COUNT; c++)
+    h.dim[c] = channel_to_float(dim, c);
+  ramp_init(&h.cut, cut);
+  ramp_init(&h.glow, glow);
+
+  kernels[selected].halo(dst, stride, 2 * radius, &h);
+}
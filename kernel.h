@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pixel kernels for 32-bit premultiplied ARGB: a solid fill for the dim
+ * layer, and the halo rasterized over the dim color in a single pass. Each
+ * has a scalar version and SSE2, AVX2 and AVX-512 variants; the best one
+ * the CPU supports is picked by kernel_init().
+ */
+
+enum kernel_isa {
+  KERNEL_SCALAR,
+  KERNEL_SSE2,
+  KERNEL_AVX2,
+  KERNEL_AVX512,
+  KERNEL_ISA_COUNT,
+};
+
+#define KERNEL_MAX_STOPS 8
+
+/* Gradient stop, not premultiplied, like pixman_gradient_stop_t */
+struct kernel_stop {
+  float offset;
+  float a, r, g, b;
+};
+
+/* Concentric radial gradient, from the center (0) to the radius (1) */
+struct kernel_gradient {
+  size_t count;
+  struct kernel_stop stops[KERNEL_MAX_STOPS];
+};
+
+void kernel_init(void);
+
+bool kernel_isa_supported(enum kernel_isa isa);
+const char *kernel_isa_name(enum kernel_isa isa);
+
+/* Switch to the given variant; fails if the CPU does not support it */
+bool kernel_select(enum kernel_isa isa);
+enum kernel_isa kernel_selected(void);
+
+/*
+ * Fill width x height pixels; 'stride' is in pixels. With 'stream' the
+ * pixels are written with non-temporal stores, bypassing the cache.
+ */
+void kernel_fill(uint32_t *dst, size_t stride, int width, int height,
+                 uint32_t pixel, bool stream);
+
+/*
+ * Rasterize a 2r x 2r halo: the 'dim' pixel, cut out with the alpha of
+ * 'cut' (OUT_REVERSE), then 'glow' on top (OVER). Same result as the pixman
+ * gradients in render.c, within rounding.
+ */
+void kernel_halo(uint32_t *dst, size_t stride, int radius, uint32_t dim,
+                 const struct kernel_gradient *cut,
+                 const struct kernel_gradient *glow);
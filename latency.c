@@ -0,0 +1,50 @@
+#include "latency.h"
+
+#include <stdio.h>
+
+#define LOG_MODULE "latency"
+#include "log.h"
+
+// Upper bucket bounds in milliseconds; the last bucket is open-ended
+static const unsigned bucket_ms[LATENCY_BUCKETS - 1] = {
+    4, 8, 12, 16, 24, 33, 50, 66, 100,
+};
+
+void latency_record(struct latency_stats *stats, uint64_t latency_ns) {
+  size_t i = 0;
+  while (i < LATENCY_BUCKETS - 1 && latency_ns >= bucket_ms[i] * 1000000ull)
+    i++;
+
+  stats->buckets[i]++;
+  stats->samples++;
+  stats->sum_ns += latency_ns;
+  if (latency_ns > stats->max_ns)
+    stats->max_ns = latency_ns;
+}
+
+void latency_log(const struct latency_stats *stats, const char *name) {
+  LOG_INFO("%s: %lu frames presented, %lu discarded, %lu refreshes missed",
+           name, stats->presented, stats->discarded, stats->missed);
+
+  if (stats->samples == 0)
+    return;
+
+  LOG_INFO("%s: input to present: %lu samples, avg %.1f ms, max %.1f ms",
+           name, stats->samples, stats->sum_ns / 1e6 / stats->samples,
+           stats->max_ns / 1e6);
+
+  for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+    if (stats->buckets[i] == 0)
+      continue;
+
+    char range[32];
+    if (i == LATENCY_BUCKETS - 1)
+      snprintf(range, sizeof(range), ">= %u ms", bucket_ms[i - 1]);
+    else
+      snprintf(range, sizeof(range), "%u-%u ms", i == 0 ? 0 : bucket_ms[i - 1],
+               bucket_ms[i]);
+
+    LOG_INFO("%s:   %-10s %8lu (%4.1f%%)", name, range, stats->buckets[i],
+             100. * stats->buckets[i] / stats->samples);
+  }
+}
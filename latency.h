@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Input-to-present latency of one output: the time from a wl_pointer.motion
+ * event to the presentation of the first frame showing it, as reported by
+ * wp_presentation feedback.
+ */
+
+#define LATENCY_BUCKETS 10
+
+struct latency_stats {
+  unsigned long samples;
+  unsigned long buckets[LATENCY_BUCKETS];
+  uint64_t sum_ns;
+  uint64_t max_ns;
+
+  unsigned long presented; // frames presented, with or without new input
+  unsigned long discarded; // frames replaced before they were shown
+  unsigned long missed;    // refresh cycles missed between commit and present
+};
+
+void latency_record(struct latency_stats *stats, uint64_t latency_ns);
+void latency_log(const struct latency_stats *stats, const char *name);
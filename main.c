@@ -2,28 +2,45 @@
 #include <errno.h>
 #include <getopt.h>
 #include <locale.h>
+#include <math.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <wayland-client.h>
 #include <wayland-cursor.h>
 
 #include <pixman.h>
 #include <tllist.h>
+#include <fractional-scale-v1.h>
+#include <presentation-time.h>
+#include <single-pixel-buffer-v1.h>
+#include <viewporter.h>
 #include <wlr-layer-shell-unstable-v1.h>
+#include <wlr-screencopy-unstable-v1.h>
+#include <xdg-output-unstable-v1.h>
 
 #define LOG_MODULE "mhalo"
 #define LOG_ENABLE_DBG 0
+#include "latency.h"
 #include "log.h"
+#include "predict.h"
+#include "render.h"
+#include "scheduler.h"
 #include "shm.h"
+#include "stats.h"
+#include "trace.h"
 #include "version.h"
+#include "workers.h"
+#include "xcursor.h"
 
 static int cursor_x = 100;
 static int cursor_y = 100;
@@ -36,13 +53,137 @@ static struct wl_compositor *compositor;
 static struct wl_shm *shm;
 static struct zwlr_layer_shell_v1 *layer_shell;
 static struct wl_seat *seat;
+static struct wl_subcompositor *subcompositor;
+static struct wp_viewporter *viewporter;
+static struct wp_single_pixel_buffer_manager_v1 *single_pixel_manager;
+static struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
+static struct wp_presentation *presentation;
+static struct zxdg_output_manager_v1 *xdg_output_manager;
+static struct zwlr_screencopy_manager_v1 *screencopy_manager;
+static clockid_t presentation_clock = CLOCK_MONOTONIC;
 
 static struct output *current_output = NULL;
 
 static bool should_exit = false;
+static struct timespec start_time;
 static bool have_argb8888 = false;
 
-static pixman_image_t *fill = NULL;
+static const pixman_color_t dim_color = {0, 0, 0, 0xbfff};
+
+/*
+ * In subsurface mode the halo is a small pre-rendered surface that is only
+ * moved around, and the dim layer is split into four strips framing it.
+ * Pointer motion then costs no pixel work at all.
+ */
+static bool subsurface_mode = false;
+
+/*
+ * In daemon mode mhalo stays connected while hidden. Every output keeps its
+ * layer surface mapped with a transparent buffer and an empty input region,
+ * and its swapchain holds a buffer already painted with the dim layer, so
+ * showing is a single commit per output. SIGUSR1 toggles.
+ */
+static bool daemon_mode = false;
+static bool visible = true;
+static struct wl_region *empty_region;
+
+/*
+ * --pulse: the halo starts large and shrinks onto the pointer, then pulses
+ * a few times and settles. The frames are PULSE_FRAMES radii between
+ * RADIUS and PULSE_RADIUS, pre-rasterized into an atlas; each step is one
+ * blit of the halo box, driven by frame callbacks.
+ */
+static bool pulse_mode = false;
+static bool pulse_started = false;
+static bool pulse_settled = false;
+static struct timespec pulse_start;
+
+#define PULSE_RADIUS (2 * RADIUS)
+#define PULSE_FRAMES 12
+#define PULSE_SHRINK_MS 400
+#define PULSE_PERIOD_MS 1200
+#define PULSE_COUNT 3
+
+/*
+ * --cursor: the halo is drawn into the pointer's cursor image, around the
+ * theme's pointer, and the compositor moves it along with the pointer. The
+ * dim layer is a stretched single pixel that never changes, so motion costs
+ * no client work at all. A cursor can only be drawn on top of the dim
+ * layer, so the halo is just its glow, without the cut-out.
+ */
+static bool cursor_mode = false;
+static struct wl_surface *cursor_surf;
+static struct wp_viewport *cursor_viewport;
+static struct buffer *cursor_buf;
+static int cursor_scale120; // of cursor_buf
+
+#define CURSOR_SIZE_DEFAULT 24
+
+static bool cursor_paint(int scale120);
+
+/*
+ * --magnify: a zoom lens inside the halo, from wlr-screencopy captures of
+ * the region around the pointer. That region is inside the halo's cut-out,
+ * so a capture of a frame without the lens shows what is below us, through
+ * the halo's faint glow. Captures are only taken once the halo has rested
+ * in one place for a moment, and the lens is only drawn while it stays
+ * there: moving frames are plain halo frames, and no frame is ever
+ * committed just to be captured.
+ */
+static int magnify = 0; // zoom factor; 0 without the lens
+
+#define MAGNIFY_DEFAULT 2
+#define MAGNIFY_MAX 4
+#define LENS_RADIUS (RADIUS * 7 / 10) // where the halo is fully cut out
+#define LENS_REST_MS 150               // still this long before a capture
+
+/*
+ * Uniform 1x1 buffers, stretched by the viewporter and shared by all
+ * outputs. Single-pixel buffers when the compositor has them, otherwise
+ * backed by a 1x1 SHM buffer.
+ */
+static struct wl_buffer *clear_pixel;
+static struct wl_buffer *dim_pixel;
+static struct buffer *clear_pixel_shm;
+static struct buffer *dim_pixel_shm;
+
+struct subsurface {
+  struct wl_surface *surf;
+  struct wl_subsurface *sub;
+  struct wp_viewport *viewport;
+  struct wl_buffer *attached;
+};
+
+enum { DIM_TOP, DIM_BOTTOM, DIM_LEFT, DIM_RIGHT, DIM_COUNT };
+
+struct frame_feedback {
+  struct output *output;
+  struct wp_presentation_feedback *feedback;
+  struct timespec commit_time; // on the presentation clock
+  bool has_input;
+  uint32_t input_time; // wl_pointer.motion time of the oldest new input, ms
+};
+
+/* A frame between paint_prepare() and paint_commit() */
+struct paint {
+  struct buffer *buf;
+  bool shared;              // buf is a shared dim buffer; nothing to paint
+  bool full;                // buffer age 0: repaint everything
+  bool restore;             // dim the halo the buffer was last painted with
+  pixman_box32_t old_halo;
+  pixman_image_t *sprite;   // NULL without halo
+  struct buffer *lens;      // capture to magnify, NULL without lens
+  bool capture;             // capture here once the halo rests
+  int x;                    // halo center, surface coordinates
+  int y;
+  int cx;                   // halo center, buffer pixels
+  int cy;
+  int r;                    // halo radius, buffer pixels
+  bool animating;           // a pulse frame; another one follows
+  uint64_t pixels;          // repainted
+  bool batched;             // painted by the jobs of render_flush()
+  uint64_t paint_ns;        // this output's share of the paint time
+};
 
 struct output {
   struct wl_output *wl_output;
@@ -54,6 +195,7 @@ struct output {
   int scale;
   int width;
   int height;
+  int32_t transform;
 
   int render_width;
   int render_height;
@@ -62,201 +204,1400 @@ struct output {
   struct zwlr_layer_surface_v1 *layer;
   bool configured;
 
+  struct wp_fractional_scale_v1 *fractional_scale;
+  uint32_t preferred_scale; // in 120ths; 0 until the compositor sends one
+
   int last_x;
   int last_y;
 
-  // Add a frame_done flag for each output
-  bool frame_done;
-  bool wants_render;
-  bool rendered_without_cursor;
-};
-static tll(struct output) outputs;
+  // Position in the global layout, from xdg-output
+  struct zxdg_output_v1 *xdg_output;
+  bool has_layout;
+  int logical_x;
+  int logical_y;
+
+  // What the last committed buffer shows, to damage only what changes
+  bool damage_all;  // the surface shows something else, e.g. after hiding
+  int shown_width;  // buffer pixels; 0 before the first commit
+  int shown_height;
+  bool shows_halo;
+  pixman_box32_t shown_halo;
+
+  // Frames painted so far; stamped into each buffer to derive its age
+  unsigned long frame;
+  // Redraw requests merged into an already pending one
+  unsigned long coalesced;
+
+  // Pending wp_presentation feedback, one per commit
+  tll(struct frame_feedback *) feedbacks;
+  struct latency_stats latency;
+  struct stats_output stats;
+  uint64_t present_delay_ns; // average commit to present time
+  struct sched sched;
+  uint64_t deadline_ns; // scheduled paint, presentation clock; 0 if none
+
+  // Full-redraw mode
+  struct shm_swapchain *chain;
+  struct buffer *dim_attached; // shared dim buffer last committed, if any
+  bool paint_pending; // picked up by render_flush()
+  struct paint paint;
+
+  // Add a frame_done flag for each output
+  bool frame_done;
+  bool wants_render;
+  bool rendered_without_cursor;
+
+  // Subsurface mode
+  struct wp_viewport *viewport;
+  struct buffer *halo_buf; // pre-rendered halo sprite
+  int halo_scale;          // scale the sprite was painted at
+  int parent_width;        // size the transparent parent is stretched to
+  int parent_height;
+  struct subsurface halo;
+  struct subsurface dim[DIM_COUNT];
+};
+static tll(struct output) outputs;
+
+/*
+ * Scales are handled in 120ths, like wp_fractional_scale_v1, so integer
+ * and fractional scales share one code path. A fractional scale needs the
+ * viewporter to map the exactly sized buffer back to the logical size.
+ */
+static int output_scale120(const struct output *output) {
+  if (output->preferred_scale > 0 && viewporter != NULL)
+    return output->preferred_scale;
+  return output->scale * 120;
+}
+
+static bool scale_in_use(int scale120) {
+  tll_foreach(outputs, it) {
+    if (output_scale120(&it->item) == scale120)
+      return true;
+  }
+  return false;
+}
+
+static void render(struct output *output);
+
+static void frame_done_callback(void *data, struct wl_callback *callback,
+                                uint32_t time) {
+  struct output *output = data;
+  TRACE(TRACE_FRAME_DONE, output->frame, output->wants_render);
+  output->frame_done = true; // Mark frame as done for this specific output
+  wl_callback_destroy(callback);
+  if (output->wants_render) {
+    output->wants_render = false;
+    render(output);
+  }
+}
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done_callback,
+};
+
+// Frames since 'buf' was last painted by 'output'; 0 if undefined
+static unsigned long buffer_age(const struct output *output,
+                                const struct buffer *buf) {
+  return buf->frame == 0 ? 0 : output->frame - buf->frame + 1;
+}
+
+static bool subsurface_init(struct subsurface *s, struct output *output) {
+  s->surf = wl_compositor_create_surface(compositor);
+  if (s->surf == NULL)
+    return false;
+
+  s->sub = wl_subcompositor_get_subsurface(subcompositor, s->surf, output->surf);
+  s->viewport = wp_viewporter_get_viewport(viewporter, s->surf);
+  s->attached = NULL;
+
+  // Let pointer events fall through to the layer surface
+  struct wl_region *empty = wl_compositor_create_region(compositor);
+  wl_surface_set_input_region(s->surf, empty);
+  wl_region_destroy(empty);
+  return true;
+}
+
+static void subsurface_destroy(struct subsurface *s) {
+  if (s->viewport != NULL)
+    wp_viewport_destroy(s->viewport);
+  if (s->sub != NULL)
+    wl_subsurface_destroy(s->sub);
+  if (s->surf != NULL)
+    wl_surface_destroy(s->surf);
+
+  *s = (struct subsurface){0};
+}
+
+/*
+ * Stretch 'buf' over (x, y, w, h) in the parent's surface coordinates, or
+ * unmap the subsurface when the rectangle is empty. Only surface state
+ * changes, so the compositor has nothing to upload unless 'buf' is new.
+ * Returns true when 'buf' got attached by this call.
+ */
+static bool subsurface_place(struct subsurface *s, struct wl_buffer *buf,
+                             int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) {
+    if (s->attached != NULL) {
+      wl_surface_attach(s->surf, NULL, 0, 0);
+      wl_surface_commit(s->surf);
+      s->attached = NULL;
+    }
+    return false;
+  }
+
+  wl_subsurface_set_position(s->sub, x, y);
+  wp_viewport_set_destination(s->viewport, w, h);
+
+  const bool attach = s->attached != buf;
+  if (attach) {
+    wl_surface_attach(s->surf, buf, 0, 0);
+    wl_surface_damage_buffer(s->surf, 0, 0, INT32_MAX, INT32_MAX);
+    s->attached = buf;
+  }
+  wl_surface_commit(s->surf);
+  return attach;
+}
+
+static struct wl_buffer *pixel_buffer_create(const pixman_color_t *color,
+                                             struct buffer **shm_buf) {
+  if (single_pixel_manager != NULL) {
+    // Widen the 16-bit (premultiplied) channels to 32 bits
+    return wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+        single_pixel_manager, color->red * 0x10001u, color->green * 0x10001u,
+        color->blue * 0x10001u, color->alpha * 0x10001u);
+  }
+
+  struct buffer *buf = shm_create_buffer(shm, 1, 1);
+  if (buf == NULL)
+    return NULL;
+
+  *(uint32_t *)buf->mmapped =
+      (uint32_t)(color->alpha >> 8) << 24 | (uint32_t)(color->red >> 8) << 16 |
+      (uint32_t)(color->green >> 8) << 8 | (uint32_t)(color->blue >> 8);
+  *shm_buf = buf;
+  return buf->wl_buf;
+}
+
+static void pixel_buffers_destroy(void) {
+  if (clear_pixel_shm == NULL && clear_pixel != NULL)
+    wl_buffer_destroy(clear_pixel);
+  if (dim_pixel_shm == NULL && dim_pixel != NULL)
+    wl_buffer_destroy(dim_pixel);
+  shm_destroy_buffer(clear_pixel_shm);
+  shm_destroy_buffer(dim_pixel_shm);
+
+  clear_pixel = dim_pixel = NULL;
+  clear_pixel_shm = dim_pixel_shm = NULL;
+}
+
+static bool pixel_buffers_create(void) {
+  clear_pixel =
+      pixel_buffer_create(&(pixman_color_t){0, 0, 0, 0}, &clear_pixel_shm);
+  dim_pixel = pixel_buffer_create(&dim_color, &dim_pixel_shm);
+
+  if (clear_pixel == NULL || dim_pixel == NULL) {
+    pixel_buffers_destroy();
+    return false;
+  }
+  return true;
+}
+
+static void subsurfaces_destroy(struct output *output) {
+  subsurface_destroy(&output->halo);
+  for (size_t i = 0; i < DIM_COUNT; i++)
+    subsurface_destroy(&output->dim[i]);
+
+  if (output->viewport != NULL)
+    wp_viewport_destroy(output->viewport);
+  output->viewport = NULL;
+
+  shm_destroy_buffer(output->halo_buf);
+  output->halo_buf = NULL;
+  output->halo_scale = 0;
+  output->parent_width = output->parent_height = 0;
+}
+
+static bool subsurfaces_setup(struct output *output) {
+  if (output->viewport == NULL) {
+    output->viewport = wp_viewporter_get_viewport(viewporter, output->surf);
+    if (!subsurface_init(&output->halo, output))
+      return false;
+    for (size_t i = 0; i < DIM_COUNT; i++) {
+      if (!subsurface_init(&output->dim[i], output))
+        return false;
+    }
+  }
+
+  const int width = output->render_width;
+  const int height = output->render_height;
+  const int scale120 = output_scale120(output);
+
+  if (output->parent_width != width || output->parent_height != height) {
+    // Stretch the transparent parent over the (new) output size
+    wl_surface_attach(output->surf, clear_pixel, 0, 0);
+    wp_viewport_set_destination(output->viewport, width, height);
+    wl_surface_damage_buffer(output->surf, 0, 0, INT32_MAX, INT32_MAX);
+    output->parent_width = width;
+    output->parent_height = height;
+  }
+
+  // The halo sprite is the only thing that needs real pixel memory
+  if (output->halo_buf != NULL && output->halo_scale == scale120)
+    return true;
+
+  // Detach first; the next subsurface_place() attaches the new sprite. The
+  // compositor keeps reading the old one until the parent commits.
+  subsurface_place(&output->halo, NULL, 0, 0, 0, 0);
+  shm_destroy_buffer_on_release(output->halo_buf);
+  output->halo_scale = 0;
+
+  const int r = scale_to_px(RADIUS, scale120);
+  output->halo_buf = shm_create_buffer(shm, 2 * r, 2 * r);
+  if (output->halo_buf == NULL)
+    return false;
+  render_halo(output->halo_buf->pix, r, r, RADIUS, scale120);
+
+  output->halo_scale = scale120;
+  return true;
+}
+
+/*
+ * Motion-to-photon latency: the time of the oldest motion event not yet
+ * committed is attached to the next commit of the current output, and
+ * compared with the presentation timestamp of that commit. Input event
+ * times are in milliseconds on an unspecified clock; in practice all
+ * compositors use CLOCK_MONOTONIC, which is also what they report as the
+ * presentation clock.
+ */
+static bool input_pending = false;
+static uint32_t input_time;
+
+static void frame_feedback_destroy(struct frame_feedback *fb) {
+  tll_foreach(fb->output->feedbacks, it) {
+    if (it->item == fb) {
+      tll_remove(fb->output->feedbacks, it);
+      break;
+    }
+  }
+  wp_presentation_feedback_destroy(fb->feedback);
+  free(fb);
+}
+
+static void feedback_sync_output(void *data,
+                                 struct wp_presentation_feedback *feedback,
+                                 struct wl_output *output) {}
+
+static void feedback_presented(void *data,
+                               struct wp_presentation_feedback *feedback,
+                               uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                               uint32_t tv_nsec, uint32_t refresh,
+                               uint32_t seq_hi, uint32_t seq_lo,
+                               uint32_t flags) {
+  struct frame_feedback *fb = data;
+  struct latency_stats *stats = &fb->output->latency;
+
+  const uint64_t present_ns =
+      (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ull + tv_nsec;
+  const uint64_t commit_ns =
+      (uint64_t)fb->commit_time.tv_sec * 1000000000ull + fb->commit_time.tv_nsec;
+
+  stats->presented++;
+
+  // A commit should be shown at the first refresh after it
+  if (refresh > 0 && present_ns > commit_ns)
+    stats->missed += (present_ns - commit_ns) / refresh;
+
+  sched_presented(&fb->output->sched, present_ns, refresh);
+
+  if (present_ns > commit_ns) {
+    struct output *output = fb->output;
+    const uint64_t delay = present_ns - commit_ns;
+    output->present_delay_ns = output->present_delay_ns == 0
+                                   ? delay
+                                   : (output->present_delay_ns * 7 + delay) / 8;
+  }
+
+  if (fb->has_input) {
+    // Compare in the 32-bit millisecond domain of the input event
+    const uint32_t ms = (uint32_t)(present_ns / 1000000) - fb->input_time;
+    if (ms < 10000)
+      latency_record(stats, ms * 1000000ull + present_ns % 1000000);
+    else
+      LOG_DBG("input and presentation clocks do not match");
+  }
+
+  frame_feedback_destroy(fb);
+}
+
+static void feedback_discarded(void *data,
+                               struct wp_presentation_feedback *feedback) {
+  struct frame_feedback *fb = data;
+  fb->output->latency.discarded++;
+  frame_feedback_destroy(fb);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+    .sync_output = &feedback_sync_output,
+    .presented = &feedback_presented,
+    .discarded = &feedback_discarded,
+};
+
+// Ask for presentation feedback on the next commit of the output's surface
+static void request_feedback(struct output *output) {
+  if (presentation == NULL)
+    return;
+
+  struct frame_feedback *fb = calloc(1, sizeof(*fb));
+  if (fb == NULL)
+    return;
+
+  fb->output = output;
+  fb->feedback = wp_presentation_feedback(presentation, output->surf);
+  clock_gettime(presentation_clock, &fb->commit_time);
+
+  if (output == current_output && input_pending) {
+    fb->has_input = true;
+    fb->input_time = input_time;
+    input_pending = false;
+  }
+
+  wp_presentation_feedback_add_listener(fb->feedback, &feedback_listener, fb);
+  tll_push_back(output->feedbacks, fb);
+}
+
+static void presentation_clock_id(void *data,
+                                  struct wp_presentation *wp_presentation,
+                                  uint32_t clk_id) {
+  presentation_clock = clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+    .clock_id = &presentation_clock_id,
+};
+
+/*
+ * The halo is drawn where the pointer should be when the frame reaches the
+ * screen: 'predict_horizon' ms after painting, or the measured commit to
+ * present delay of the output if negative. 0 turns prediction off.
+ */
+static int predict_horizon = -1;
+static struct predictor predictor;
+
+// Without wp_presentation feedback, assume the next refresh at 60 Hz
+#define PREDICT_DEFAULT_MS 16
+
+static void halo_position(const struct output *output, int *x, int *y) {
+  *x = cursor_x;
+  *y = cursor_y;
+  if (predict_horizon == 0 || output != current_output)
+    return;
+
+  int horizon = predict_horizon;
+  if (horizon < 0) {
+    horizon = output->present_delay_ns > 0
+                  ? (int)((output->present_delay_ns + 500000) / 1000000)
+                  : PREDICT_DEFAULT_MS;
+  }
+
+  // Motion timestamps are on CLOCK_MONOTONIC in practice; see above
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const uint32_t now_ms = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+  double px, py;
+  if (!predict_position(&predictor, now_ms, horizon, &px, &py))
+    return;
+
+  // Keep the halo on the output it is drawn on
+  const int max_x = output->render_width - 1;
+  const int max_y = output->render_height - 1;
+  *x = px < 0 ? 0 : px > max_x ? max_x : (int)px;
+  *y = py < 0 ? 0 : py > max_y ? max_y : (int)py;
+}
+
+/*
+ * The pointer is on current_output, but near an edge its halo reaches onto
+ * the neighbouring outputs. With their positions in the global layout,
+ * each one draws its part of the halo. Without xdg-output, only the
+ * current output does.
+ */
+static int halo_x; // the halo of the frames being painted, on current_output
+static int halo_y;
+
+/* The halo centered at (x, y) on current_output in 'output's coordinates */
+static bool halo_on_output(const struct output *output, int x, int y,
+                           int *ox, int *oy) {
+  if (current_output == NULL)
+    return false;
+
+  if (output == current_output) {
+    *ox = x;
+    *oy = y;
+    return true;
+  }
+
+  if (!output->has_layout || !current_output->has_layout)
+    return false;
+
+  *ox = x + current_output->logical_x - output->logical_x;
+  *oy = y + current_output->logical_y - output->logical_y;
+
+  const int r = pulse_mode && !pulse_settled ? PULSE_RADIUS : RADIUS;
+  return *ox + r > 0 && *ox - r < output->render_width && *oy + r > 0 &&
+         *oy - r < output->render_height;
+}
+
+/*
+ * The lens' capture. One buffer is enough: a new capture only starts once
+ * the halo has left the position of the previous one, whose lens is then
+ * no longer drawn.
+ */
+static struct {
+  struct zwlr_screencopy_frame_v1 *frame; // in flight, NULL if none
+  struct output *output; // of the capture of this position, NULL if none
+  int x;                 // and its center
+  int y;
+  bool frame_y_invert;
+
+  struct buffer *buf;
+  uint32_t format;
+  bool done; // 'buf' holds the capture of this position
+  bool y_invert;
+} capture;
+
+static int capture_fd = -1; // fires once the halo has rested
+
+static void capture_cancel(void) {
+  if (capture.frame != NULL)
+    zwlr_screencopy_frame_v1_destroy(capture.frame);
+  capture.frame = NULL;
+}
+
+/* Forget the capture, e.g. once the halo has left its position */
+static void capture_forget(void) {
+  capture_cancel();
+  capture.output = NULL;
+  capture.done = false;
+}
+
+static void capture_reset(void) {
+  capture_forget();
+  shm_destroy_buffer(capture.buf);
+  capture.buf = NULL;
+}
+
+static void capture_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
+                           uint32_t format, uint32_t width, uint32_t height,
+                           uint32_t stride) {
+  struct buffer **buf = &capture.buf;
+  if (*buf != NULL &&
+      ((*buf)->width != (int)width || (*buf)->height != (int)height ||
+       (*buf)->stride != (int)stride || capture.format != format)) {
+    shm_destroy_buffer(*buf);
+    *buf = NULL;
+  }
+
+  if (*buf == NULL) {
+    *buf = shm_create_buffer_format(shm, width, height, format);
+    capture.format = format;
+  }
+
+  if (*buf == NULL || (*buf)->stride != (int)stride) {
+    LOG_WARN("screencopy: no buffer for %ux%u, stride %u, format 0x%08x; "
+             "disabling the magnifier",
+             width, height, stride, format);
+    capture_reset();
+    magnify = 0;
+    return;
+  }
+
+  zwlr_screencopy_frame_v1_copy(frame, (*buf)->wl_buf);
+}
+
+static void capture_flags(void *data, struct zwlr_screencopy_frame_v1 *frame,
+                          uint32_t flags) {
+  capture.frame_y_invert = flags & ZWLR_SCREENCOPY_FRAME_V1_FLAGS_Y_INVERT;
+}
+
+static void capture_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
+                          uint32_t tv_sec_hi, uint32_t tv_sec_lo,
+                          uint32_t tv_nsec) {
+  capture_cancel();
+  capture.done = true;
+  capture.y_invert = capture.frame_y_invert;
+
+  // Draw the lens
+  if (capture.output == current_output)
+    render(capture.output);
+}
+
+static void capture_failed(void *data, struct zwlr_screencopy_frame_v1 *frame) {
+  // This position is not captured again
+  LOG_DBG("screencopy: capture failed");
+  capture_cancel();
+}
+
+static void capture_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+                           uint32_t x, uint32_t y, uint32_t width,
+                           uint32_t height) {}
+
+static void capture_linux_dmabuf(void *data,
+                                 struct zwlr_screencopy_frame_v1 *frame,
+                                 uint32_t format, uint32_t width,
+                                 uint32_t height) {}
+
+static void capture_buffer_done(void *data,
+                                struct zwlr_screencopy_frame_v1 *frame) {}
+
+static const struct zwlr_screencopy_frame_v1_listener capture_listener = {
+    .buffer = &capture_buffer,
+    .flags = &capture_flags,
+    .ready = &capture_ready,
+    .failed = &capture_failed,
+    .damage = &capture_damage,
+    .linux_dmabuf = &capture_linux_dmabuf,
+    .buffer_done = &capture_buffer_done,
+};
+
+/*
+ * Whether the region around the halo at (x, y), in surface coordinates,
+ * can be captured whole. Near the edges it would be clipped and no longer
+ * centered, so there is no lens there.
+ */
+static bool capture_fits(const struct output *output, int x, int y) {
+  const int r = LENS_RADIUS / magnify;
+  return output->transform == WL_OUTPUT_TRANSFORM_NORMAL && x - r >= 0 &&
+         y - r >= 0 && x + r <= output->render_width &&
+         y + r <= output->render_height;
+}
+
+static bool capture_at(const struct output *output, int x, int y) {
+  return capture.output == output && capture.x == x && capture.y == y;
+}
+
+/* (Re)start the wait for the halo to rest */
+static void capture_arm(void) {
+  const struct itimerspec spec = {
+      .it_value = {.tv_sec = LENS_REST_MS / 1000,
+                   .tv_nsec = LENS_REST_MS % 1000 * 1000000l},
+  };
+  if (timerfd_settime(capture_fd, 0, &spec, NULL) < 0)
+    LOG_ERRNO("failed to arm the magnifier timer");
+}
+
+/*
+ * The halo has not moved for LENS_REST_MS: capture the frame on screen,
+ * which has no lens yet, around it
+ */
+static void capture_rested(void) {
+  uint64_t expirations;
+  if (read(capture_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    LOG_ERRNO("failed to read from the magnifier timer");
+
+  struct output *output = current_output;
+  if (!visible || output == NULL)
+    return;
+
+  // Still catching up with the pointer; that frame waits again
+  const int x = output->last_x;
+  const int y = output->last_y;
+  if (x != cursor_x || y != cursor_y)
+    return;
+
+  if (capture.output != NULL || !capture_fits(output, x, y))
+    return;
+
+  const int r = LENS_RADIUS / magnify;
+  capture.output = output;
+  capture.x = x;
+  capture.y = y;
+  capture.frame_y_invert = false;
+  capture.frame = zwlr_screencopy_manager_v1_capture_output_region(
+      screencopy_manager, false, output->wl_output, x - r, y - r, 2 * r,
+      2 * r);
+  zwlr_screencopy_frame_v1_add_listener(capture.frame, &capture_listener,
+                                        NULL);
+}
+
+static void render_subsurfaces(struct output *output) {
+  if (!subsurfaces_setup(output)) {
+    LOG_ERR("failed to set up subsurfaces");
+    return;
+  }
+
+  const int width = output->render_width;
+  const int height = output->render_height;
+
+  int x, y;
+  halo_position(output, &x, &y);
+
+  // Visible part of the halo box, in surface coordinates
+  const int hx = x - RADIUS;
+  const int hy = y - RADIUS;
+  int x0 = hx < 0 ? 0 : hx;
+  int y0 = hy < 0 ? 0 : hy;
+  int x1 = hx + 2 * RADIUS > width ? width : hx + 2 * RADIUS;
+  int y1 = hy + 2 * RADIUS > height ? height : hy + 2 * RADIUS;
+
+  if (output != current_output || x0 >= x1 || y0 >= y1) {
+    // No halo; the top strip covers the whole output
+    x0 = x1 = 0;
+    y0 = y1 = height;
+  } else {
+    /*
+     * Crop the sprite so it never spills past the output edge. The source
+     * rectangle is in sprite pixels; rounding every term down keeps it
+     * inside the buffer at fractional scales.
+     */
+    const int64_t px = output->halo_buf->width;
+    const int64_t box = 2 * RADIUS;
+    wp_viewport_set_source(output->halo.viewport,
+                           (wl_fixed_t)((x0 - hx) * px * 256 / box),
+                           (wl_fixed_t)((y0 - hy) * px * 256 / box),
+                           (wl_fixed_t)((x1 - x0) * px * 256 / box),
+                           (wl_fixed_t)((y1 - y0) * px * 256 / box));
+  }
+
+  if (subsurface_place(&output->halo, output->halo_buf->wl_buf, x0, y0,
+                       x1 - x0, y1 - y0))
+    output->halo_buf->busy = true;
+  subsurface_place(&output->dim[DIM_TOP], dim_pixel, 0, 0, width, y0);
+  subsurface_place(&output->dim[DIM_BOTTOM], dim_pixel, 0, y1, width,
+                   height - y1);
+  subsurface_place(&output->dim[DIM_LEFT], dim_pixel, 0, y0, x0, y1 - y0);
+  subsurface_place(&output->dim[DIM_RIGHT], dim_pixel, x1, y0, width - x1,
+                   y1 - y0);
+
+  output->frame_done = false;
+  output->frame++;
+  output->stats.frames++;
+  output->last_x = x;
+  output->last_y = y;
+  output->rendered_without_cursor = output != current_output;
+
+  // Extrapolated; catch up with the real position if the pointer stops
+  if (x != cursor_x || y != cursor_y)
+    output->wants_render = true;
+
+  struct wl_callback *callback = wl_surface_frame(output->surf);
+  wl_callback_add_listener(callback, &frame_listener, output);
+
+  request_feedback(output);
+
+  // Subsurfaces are synchronized; this applies all of the above atomically
+  wl_surface_commit(output->surf);
+}
+
+/* --cursor: the whole surface is the dim layer; there is nothing to redraw */
+static void render_dim_layer(struct output *output) {
+  if (output->viewport == NULL)
+    output->viewport = wp_viewporter_get_viewport(viewporter, output->surf);
+  wl_surface_set_buffer_scale(output->surf, 1);
+  wl_surface_attach(output->surf, dim_pixel, 0, 0);
+  wp_viewport_set_destination(output->viewport, output->render_width,
+                              output->render_height);
+  wl_surface_damage_buffer(output->surf, 0, 0, INT32_MAX, INT32_MAX);
+
+  output->frame++;
+  output->stats.frames++;
+  output->rendered_without_cursor = true;
+  wl_surface_commit(output->surf);
+}
+
+static void output_hide(struct output *output);
+
+static void render_now(struct output *output) {
+  if (subsurface_mode) {
+    render_subsurfaces(output);
+    return;
+  }
+  if (cursor_mode) {
+    render_dim_layer(output);
+    return;
+  }
+
+  // Painted by render_flush(), together with the other outputs
+  if (output->paint_pending)
+    output->coalesced++;
+  output->paint_pending = true;
+}
+
+/*
+ * With --deadline, a frame is not painted when the pointer moves but just
+ * before the output's next refresh, as predicted from wp_presentation
+ * feedback. It then shows the freshest pointer position, and motion that
+ * arrives in between costs nothing. One timerfd serves all outputs.
+ */
+static int deadline_slack_ms = -1; // < 0: paint right away
+static int sched_fd = -1;
+static uint64_t sched_armed_ns;
+
+#define DEADLINE_DEFAULT_MS 2
+// Closer to the deadline than this, just paint
+#define DEADLINE_MIN_WAIT_NS 200000ull
+
+static uint64_t presentation_now_ns(void) {
+  struct timespec now;
+  clock_gettime(presentation_clock, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void schedule_arm(void) {
+  uint64_t earliest = 0;
+  tll_foreach(outputs, it) {
+    const uint64_t d = it->item.deadline_ns;
+    if (d != 0 && (earliest == 0 || d < earliest))
+      earliest = d;
+  }
+
+  if (earliest == sched_armed_ns)
+    return;
+
+  // All zero disarms
+  struct itimerspec spec = {
+      .it_value = {.tv_sec = earliest / 1000000000ull,
+                   .tv_nsec = earliest % 1000000000ull},
+  };
+  if (timerfd_settime(sched_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+    LOG_ERRNO("failed to arm the frame timer");
+  sched_armed_ns = earliest;
+}
+
+// Returns true if the frame was deferred to the output's deadline
+static bool schedule(struct output *output) {
+  if (sched_fd < 0)
+    return false;
+
+  if (output->deadline_ns != 0) {
+    output->coalesced++;
+    return true;
+  }
+
+  const uint64_t now = presentation_now_ns();
+  const uint64_t deadline =
+      sched_deadline(&output->sched, now, deadline_slack_ms * 1000000ull);
+  if (deadline < now + DEADLINE_MIN_WAIT_NS)
+    return false;
+
+  output->deadline_ns = deadline;
+  schedule_arm();
+  return true;
+}
+
+static void schedule_expired(void) {
+  uint64_t expirations;
+  if (read(sched_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    LOG_ERRNO("failed to read from the frame timer");
+
+  const uint64_t now = presentation_now_ns();
+  sched_armed_ns = 0;
+
+  tll_foreach(outputs, it) {
+    struct output *output = &it->item;
+    if (output->deadline_ns == 0 ||
+        output->deadline_ns > now + DEADLINE_MIN_WAIT_NS)
+      continue;
+
+    output->deadline_ns = 0;
+    if (visible && output->configured)
+      render_now(output);
+  }
+
+  schedule_arm();
+}
+
+static void render(struct output *output) {
+  TRACE(TRACE_RENDER, output->frame, output->frame_done);
+
+  // Nothing to draw while hidden, until the size or scale changes
+  if (!visible) {
+    if (!output->rendered_without_cursor)
+      output_hide(output);
+    return;
+  }
+
+  if (!output->frame_done) {
+    if (output->wants_render)
+      output->coalesced++;
+    output->wants_render = true;
+    output->stats.skipped_busy++;
+    return; // Skip rendering if the previous frame isn't done
+  }
+  //
+  // If the halo is not on the output and it has already been rendered
+  // without it, skip rendering
+  int x, y;
+  if (output->rendered_without_cursor &&
+      !halo_on_output(output, cursor_x, cursor_y, &x, &y)) {
+    output->stats.skipped_idle++;
+    return;
+  }
+
+  if (schedule(output))
+    return;
+
+  render_now(output);
+}
+
+/*
+ * Full-redraw frames are painted in three steps: paint_prepare() picks a
+ * buffer and what to repaint, the pixel work of all outputs then runs as
+ * one batch of jobs on the worker threads, and paint_commit() hands the
+ * buffers to the compositor. Only the main thread talks to Wayland.
+ *
+ * A full repaint is split into bands of about PAINT_BAND_BYTES, which keeps
+ * the jobs small enough to balance across threads and outputs.
+ */
+#define PAINT_BAND_BYTES (256 * 1024)
+
+struct paint_job {
+  struct output *output;
+  int y1;
+  int y2;
+};
+
+static struct paint_job *paint_jobs = NULL;
+static size_t paint_jobs_size = 0;
+
+/* Atlas frame for 'ms' into the pulse animation, -1 once it has settled */
+static int pulse_frame(long ms) {
+  if (ms < PULSE_SHRINK_MS) {
+    // Fast at first, slowing down as it closes in on the pointer
+    const double t = 1. - (double)ms / PULSE_SHRINK_MS;
+    return (int)lround(t * t * (PULSE_FRAMES - 1));
+  }
+
+  ms -= PULSE_SHRINK_MS;
+  if (ms >= PULSE_PERIOD_MS * PULSE_COUNT)
+    return -1;
+
+  // Gentle pulses up to half the shrink's starting size
+  const double phase = (double)(ms % PULSE_PERIOD_MS) / PULSE_PERIOD_MS;
+  return (int)lround((1. - cos(2. * M_PI * phase)) / 2. * (PULSE_FRAMES - 1) /
+                     2.);
+}
+
+static pixman_image_t *halo_sprite(int scale120, bool *animating) {
+  *animating = false;
+
+  if (pulse_mode && !pulse_settled) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!pulse_started) {
+      pulse_started = true;
+      pulse_start = now;
+    }
+
+    const long ms = (now.tv_sec - pulse_start.tv_sec) * 1000 +
+                    (now.tv_nsec - pulse_start.tv_nsec) / 1000000;
+    const int frame = pulse_frame(ms);
+    if (frame >= 0) {
+      pixman_image_t *pix = render_atlas_frame(RADIUS, PULSE_RADIUS,
+                                               PULSE_FRAMES, frame, scale120);
+      if (pix != NULL) {
+        *animating = true;
+        return pix;
+      }
+    }
+
+    // Settled (or out of memory): back to the static sprite for good
+    pulse_settled = true;
+    if (!daemon_mode)
+      render_drop_atlases();
+  }
+
+  return render_halo_sprite(RADIUS, scale120);
+}
+
+static void region_add_box(pixman_region32_t *region,
+                           const pixman_box32_t *box) {
+  pixman_region32_union_rect(region, region, box->x1, box->y1,
+                             box->x2 - box->x1, box->y2 - box->y1);
+}
+
+/*
+ * What an incremental repaint covers: the halo the buffer still holds and
+ * the new one, merged so that no pixel is painted twice.
+ */
+static void paint_region(const struct paint *p, pixman_region32_t *region) {
+  pixman_region32_init(region);
+  if (p->restore)
+    region_add_box(region, &p->old_halo);
+  if (p->sprite != NULL) {
+    const int r = pixman_image_get_width(p->sprite) / 2;
+    pixman_region32_union_rect(region, region, p->cx - r, p->cy - r, 2 * r,
+                               2 * r);
+  }
+  pixman_region32_intersect_rect(region, region, 0, 0, p->buf->width,
+                                 p->buf->height);
+}
+
+/*
+ * Outputs without the halo all show the same dim pixels, so instead of
+ * painting a buffer of their own, all outputs of one buffer size share a
+ * single dim buffer that is never written again. Only outputs the pointer
+ * has visited ever get a swapchain.
+ */
+static tll(struct buffer *) dim_buffers;
+
+static struct buffer *dim_buffer_get(int width, int height) {
+  tll_foreach(dim_buffers, it) {
+    if (it->item->width == width && it->item->height == height)
+      return it->item;
+  }
+
+  struct buffer *buf = shm_create_buffer(shm, width, height);
+  if (buf == NULL)
+    return NULL;
+
+  render_dim(buf->pix, 0, 0, width, height);
+  tll_push_back(dim_buffers, buf);
+  return buf;
+}
+
+static bool dim_buffer_in_use(const struct buffer *buf) {
+  tll_foreach(outputs, it) {
+    const struct output *output = &it->item;
+    const int scale120 = output_scale120(output);
+    if (output->dim_attached == buf ||
+        (buf->width == scale_to_px(output->render_width, scale120) &&
+         buf->height == scale_to_px(output->render_height, scale120)))
+      return true;
+  }
+  return false;
+}
+
+/* Free the dim buffers of sizes no output has, once no surface shows them */
+static void dim_buffers_prune(void) {
+  tll_foreach(dim_buffers, it) {
+    if (!dim_buffer_in_use(it->item)) {
+      shm_destroy_buffer(it->item);
+      tll_remove(dim_buffers, it);
+    }
+  }
+}
+
+/* No frame callback may be pending, so a buffer release has to retry */
+static void swapchain_released(void *data) {
+  struct output *output = data;
+  if (output->wants_render && output->frame_done) {
+    output->wants_render = false;
+    render(output);
+  }
+}
+
+static bool paint_prepare(struct output *output) {
+  const int scale120 = output_scale120(output);
+  const int buf_width = scale_to_px(output->render_width, scale120);
+  const int buf_height = scale_to_px(output->render_height, scale120);
+  const int radius = scale_to_px(RADIUS, scale120);
+
+  int x, y;
+  const bool halo = halo_on_output(output, halo_x, halo_y, &x, &y);
+
+  if (!halo) {
+    struct buffer *dim = dim_buffer_get(buf_width, buf_height);
+    if (dim != NULL) {
+      output->paint = (struct paint){.buf = dim, .shared = true, .r = radius};
+      output->frame++;
+      return true;
+    }
+    // Out of memory for it; paint a buffer of our own
+  }
+
+  if (output->chain == NULL)
+    output->chain = shm_swapchain_create(shm, swapchain_released, output);
+
+  struct buffer *buf =
+      shm_swapchain_acquire(output->chain, buf_width, buf_height);
+
+  if (!buf) {
+    // Paint this frame once the compositor hands a buffer back
+    output->wants_render = true;
+    return false;
+  }
+
+  struct paint *p = &output->paint;
+  *p = (struct paint){.buf = buf};
+
+  /*
+   * A reused buffer already holds the dim layer plus the halo it was last
+   * painted with. Restoring just that box keeps the per-frame pixel work
+   * proportional to the halo, not the output.
+   */
+  p->full = buffer_age(output, buf) == 0;
+  p->restore = !p->full && buf->has_halo;
+  p->old_halo = buf->halo;
+
+  buf->has_halo = false;
+  buf->frame = ++output->frame;
+
+  p->r = radius;
+  if (halo) {
+    // Rasterized here if needed: the jobs only read the sprite cache
+    p->sprite = halo_sprite(scale120, &p->animating);
+    if (p->sprite != NULL)
+      p->r = pixman_image_get_width(p->sprite) / 2;
+    p->x = x;
+    p->y = y;
+    p->cx = scale_to_px(p->x, scale120);
+    p->cy = scale_to_px(p->y, scale120);
+    buf->has_halo = render_halo_box(&buf->halo, p->cx, p->cy, p->r,
+                                    buf->width, buf->height);
+
+    if (magnify > 0 && output == current_output && p->sprite != NULL &&
+        capture_fits(output, x, y)) {
+      // Only the capture of this very position; any other would lag behind
+      if (!capture_at(output, x, y))
+        p->capture = true;
+      else if (capture.done)
+        p->lens = capture.buf;
+    }
+  }
+
+  if (p->full) {
+    p->pixels = (uint64_t)buf->width * buf->height;
+  } else {
+    pixman_region32_t region;
+    paint_region(p, &region);
+
+    int count;
+    const pixman_box32_t *rects = pixman_region32_rectangles(&region, &count);
+    for (int i = 0; i < count; i++) {
+      p->pixels += (uint64_t)(rects[i].x2 - rects[i].x1) *
+                   (rects[i].y2 - rects[i].y1);
+    }
+    pixman_region32_fini(&region);
+  }
+  output->stats.pixels += p->pixels;
+  return true;
+}
+
+static void paint_job_run(void *data, size_t index) {
+  const struct paint_job *job = &((const struct paint_job *)data)[index];
+  const struct paint *p = &job->output->paint;
+  pixman_image_t *pix = p->buf->pix;
+
+  TRACE_BEGIN(TRACE_PAINT_JOB, job->y1, job->y2);
+
+  if (p->full) {
+    const pixman_box32_t band = {0, job->y1, p->buf->width, job->y2};
+    render_rect(pix, &band, p->sprite, p->cx, p->cy, true);
+    TRACE_END(TRACE_PAINT_JOB, job->y1, job->y2);
+    return;
+  }
+
+  pixman_region32_t region;
+  paint_region(p, &region);
+
+  int count;
+  const pixman_box32_t *rects = pixman_region32_rectangles(&region, &count);
+  for (int i = 0; i < count; i++)
+    render_rect(pix, &rects[i], p->sprite, p->cx, p->cy, false);
+  pixman_region32_fini(&region);
+
+  TRACE_END(TRACE_PAINT_JOB, job->y1, job->y2);
+}
+
+static bool paint_jobs_reserve(size_t count) {
+  if (count <= paint_jobs_size)
+    return true;
+
+  struct paint_job *jobs = realloc(paint_jobs, count * sizeof(jobs[0]));
+  if (jobs == NULL) {
+    LOG_ERRNO("failed to allocate %zu paint jobs", count);
+    return false;
+  }
+  paint_jobs = jobs;
+  paint_jobs_size = count;
+  return true;
+}
+
+/*
+ * Both buffers are the dim layer plus at most one halo, so they can only
+ * differ where either shows its halo. Damage exactly that, clipped to the
+ * buffer, as the few rectangles of a pixman region.
+ */
+static void damage_buffer(struct output *output, const struct buffer *buf) {
+  pixman_region32_t damage;
+
+  if (output->damage_all || output->shown_width != buf->width ||
+      output->shown_height != buf->height) {
+    pixman_region32_init_rect(&damage, 0, 0, buf->width, buf->height);
+  } else {
+    pixman_region32_init(&damage);
+    if (output->shows_halo)
+      region_add_box(&damage, &output->shown_halo);
+    if (buf->has_halo)
+      region_add_box(&damage, &buf->halo);
+    pixman_region32_intersect_rect(&damage, &damage, 0, 0, buf->width,
+                                   buf->height);
+  }
+
+  int count;
+  const pixman_box32_t *rects = pixman_region32_rectangles(&damage, &count);
+  for (int i = 0; i < count; i++) {
+    wl_surface_damage_buffer(output->surf, rects[i].x1, rects[i].y1,
+                             rects[i].x2 - rects[i].x1,
+                             rects[i].y2 - rects[i].y1);
+  }
+  pixman_region32_fini(&damage);
+
+  output->damage_all = false;
+  output->shown_width = buf->width;
+  output->shown_height = buf->height;
+  output->shows_halo = buf->has_halo;
+  output->shown_halo = buf->halo;
+}
+
+static void paint_commit(struct output *output) {
+  const int width = output->render_width;
+  const int height = output->render_height;
+  struct buffer *buf = output->paint.buf;
+
+  output->paint.buf = NULL;
+  output->frame_done = false;
+  output->dim_attached = output->paint.shared ? buf : NULL;
+
+  if (viewporter != NULL) {
+    // Buffer pixels map 1:1 to physical pixels, also at fractional scales
+    if (output->viewport == NULL)
+      output->viewport = wp_viewporter_get_viewport(viewporter, output->surf);
+    wl_surface_set_buffer_scale(output->surf, 1);
+    wp_viewport_set_destination(output->viewport, width, height);
+  } else {
+    wl_surface_set_buffer_scale(output->surf, output->scale);
+  }
+  wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
+  damage_buffer(output, buf);
+
+  if (output == current_output) {
+    output->last_x = output->paint.x;
+    output->last_y = output->paint.y;
+
+    // Extrapolated; catch up with the real position if the pointer stops
+    if (output->last_x != cursor_x || output->last_y != cursor_y)
+      output->wants_render = true;
+  }
+
+  // Keep the pulse going, also on the neighbours it reaches
+  if (output->paint.animating)
+    output->wants_render = true;
+
+  // Set the flag if the output is rendered without (part of) the halo
+  output->rendered_without_cursor =
+      output != current_output && output->paint.sprite == NULL;
+
+  // Create a callback to know when the frame is done
+  struct wl_callback *callback = wl_surface_frame(output->surf);
+  wl_callback_add_listener(callback, &frame_listener,
+                           output); // Pass output as data
+
+  request_feedback(output);
+  wl_surface_commit(output->surf);
+
+  // A capture is only good while the halo stays where it was taken
+  if (output == current_output && capture.output != NULL &&
+      !capture_at(output, output->paint.x, output->paint.y))
+    capture_forget();
+  if (output->paint.capture)
+    capture_arm();
+
+  if (output->frame == 1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    LOG_INFO("output: %s %s: first frame after %.1f ms", output->make,
+             output->model,
+             (now.tv_sec - start_time.tv_sec) * 1e3 +
+                 (now.tv_nsec - start_time.tv_nsec) / 1e6);
+  }
+}
+
+/* Hidden: keep the painted buffer for when we are shown again */
+static void paint_keep(struct output *output) {
+  if (!output->paint.shared)
+    shm_swapchain_put_back(output->paint.buf);
+  output->paint.buf = NULL;
+}
+
+/*
+ * Hidden: dim one swapchain buffer ahead of time, so the first frame after
+ * showing only paints the halo into memory that is already mapped
+ */
+static void paint_prewarm(struct output *output) {
+  const int scale120 = output_scale120(output);
+  const int buf_width = scale_to_px(output->render_width, scale120);
+  const int buf_height = scale_to_px(output->render_height, scale120);
+
+  if (output->chain == NULL)
+    output->chain = shm_swapchain_create(shm, swapchain_released, output);
 
-static bool stretch = false;
+  struct buffer *buf =
+      shm_swapchain_acquire(output->chain, buf_width, buf_height);
+  if (buf == NULL)
+    return;
 
-static void render(struct output *output);
+  render_dim(buf->pix, 0, 0, buf_width, buf_height);
+  buf->has_halo = false;
+  buf->frame = ++output->frame;
 
-static void frame_done_callback(void *data, struct wl_callback *callback,
-                                uint32_t time) {
-  struct output *output = data;
-  output->frame_done = true; // Mark frame as done for this specific output
-  wl_callback_destroy(callback);
-  if (output->wants_render) {
-    output->wants_render = false;
-    render(output);
-  }
+  output->paint = (struct paint){.buf = buf};
+  paint_keep(output);
 }
 
-static const struct wl_callback_listener frame_listener = {
-    .done = frame_done_callback,
-};
+/* Paint and commit every output render() has scheduled */
+static void render_flush(void) {
+  size_t count = 0;
+  uint64_t batch_pixels = 0;
+  bool painting = false;
 
-static void draw_circle(pixman_image_t *pix, int x, int y, int radius) {
-  int width = pixman_image_get_width(pix);
-  int height = pixman_image_get_height(pix);
-
-  pixman_color_t white = {0xFFFF, 0xFFFF, 0xFFFF, 0x3FFF};
-
-  for (int j = y - radius; j <= y + radius; j++) {
-      int start = -1, end = -1;
-    for (int i = x - radius; i <= x + radius; i++) {
-      if (i >= 0 && i < width && j >= 0 && j < height) {
-        int dx = i - x;
-        int dy = j - y;
-        if (dx * dx + dy * dy <= radius * radius) {
-          if (start < 0) start = i;
-          end = i;
-        }
-      }
+  // One position for all outputs, so the parts of the halo line up
+  if (current_output != NULL)
+    halo_position(current_output, &halo_x, &halo_y);
+
+  tll_foreach(outputs, it) {
+    struct output *output = &it->item;
+    if (!output->paint_pending)
+      continue;
+
+    if (!painting) {
+      painting = true;
+      TRACE_BEGIN(TRACE_PAINT, 0, 0);
     }
-    if (end > 0) {
-        pixman_image_fill_rectangles(PIXMAN_OP_HSL_LUMINOSITY, pix, &white, 1,
-                                       &(pixman_rectangle16_t){start, j, end-start, 1});
+
+    output->paint_pending = false;
+    const uint64_t start = presentation_now_ns();
+    if (!paint_prepare(output))
+      continue;
+
+    struct paint *p = &output->paint;
+    const struct buffer *buf = p->buf;
+    const int band = p->full ? PAINT_BAND_BYTES / buf->stride + 1 : buf->height;
+
+    if (p->shared) {
+      // Nothing to paint
+    } else if (!render_rect_threaded(buf->pix, p->sprite) ||
+               !paint_jobs_reserve(count + (buf->height + band - 1) / band)) {
+      // The pixman fallback is single-threaded; paint without the pool
+      struct paint_job job = {output, 0, buf->height};
+      paint_job_run(&job, 0);
+    } else {
+      for (int y = 0; y < buf->height; y += band) {
+        paint_jobs[count++] = (struct paint_job){
+            .output = output,
+            .y1 = y,
+            .y2 = y + band < buf->height ? y + band : buf->height,
+        };
+      }
+      p->batched = true;
+      batch_pixels += p->pixels;
     }
+    p->paint_ns = presentation_now_ns() - start;
   }
-}
 
-#define double_to_color(x)					\
-    (((uint32_t) ((x)*65536)) - (((uint32_t) ((x)*65536)) >> 16))
+  const uint64_t batch_start = presentation_now_ns();
+  workers_run(&paint_job_run, paint_jobs, count);
+  const uint64_t batch_ns = presentation_now_ns() - batch_start;
 
-#define PIXMAN_STOP(offset,r,g,b,a)		\
-    { pixman_double_to_fixed (offset),		\
-	{					\
-	double_to_color (r),			\
-	double_to_color (g),			\
-	double_to_color (b),			\
-	double_to_color (a)			\
-	}					\
+  tll_foreach(outputs, it) {
+    struct paint *p = &it->item.paint;
+    if (p->buf == NULL)
+      continue;
+
+    // The jobs of all outputs run as one batch; split it by pixels painted
+    if (p->batched && batch_pixels > 0)
+      p->paint_ns += batch_ns * p->pixels / batch_pixels;
+
+    const uint64_t start = presentation_now_ns();
+
+    // Inside the halo box, after the jobs; pixman transforms are main
+    // thread only. Only now read 'pix': creating buffers in the same pool,
+    // e.g. another output's dim buffer, may have replaced it.
+    if (p->lens != NULL) {
+      render_lens(p->buf->pix, p->lens->pix, capture.y_invert, p->cx, p->cy,
+                  scale_to_px(LENS_RADIUS, output_scale120(&it->item)));
     }
 
+    if (visible)
+      paint_commit(&it->item);
+    else
+      paint_keep(&it->item);
 
-void draw_circle_with_gradient(pixman_image_t* image, int cx, int cy, int radius) {
-    // Define the points for the radial gradient
-    pixman_point_fixed_t inner_circle = { pixman_int_to_fixed(radius), pixman_int_to_fixed(radius) };
-    pixman_point_fixed_t outer_circle = { pixman_int_to_fixed(radius), pixman_int_to_fixed(radius) };
-    
-    pixman_fixed_t inner_radius = pixman_int_to_fixed(0);
-    pixman_fixed_t outer_radius = pixman_int_to_fixed(radius);
-    
-    // Define the colors for the gradient: fully transparent at the center, fully opaque at the outer edge
-    pixman_gradient_stop_t stops[3] = {
-      PIXMAN_STOP (0.0,        1, 1, 1, 1),
-      PIXMAN_STOP (0.7,        1, 1, 1, 1),
-      PIXMAN_STOP (1.0,        0, 0, 0, 0),
-    };
-    
-      pixman_gradient_stop_t stops2[4] = {
-      PIXMAN_STOP (0.0,        1, 1, 1, 0.15),
-      PIXMAN_STOP (0.7,        1, 1, 1, 0.1),
-      PIXMAN_STOP (0.8,        1, 1, 0.31, 0.3),
-      PIXMAN_STOP (1.0,        0, 0, 0, 0),
-    };
-    
+    p->paint_ns += presentation_now_ns() - start;
+    sched_painted(&it->item.sched, p->paint_ns);
+    stats_hist_add(&it->item.stats.paint_ns, p->paint_ns);
+    it->item.stats.frames++;
+  }
 
-    
-    // Create the gradient
-    pixman_image_t *radial_gradient = pixman_image_create_radial_gradient(
-        &inner_circle, &outer_circle,
-        inner_radius, outer_radius,
-        stops, 3
-    );
-    
-        // Create the gradient
-    pixman_image_t *radial_gradient2 = pixman_image_create_radial_gradient(
-        &inner_circle, &outer_circle,
-        inner_radius, outer_radius,
-        stops2, 4
-    );
-    
-    // Set the gradient as the source and composite it onto the image
-    pixman_image_composite32(
-        PIXMAN_OP_OUT_REVERSE, 
-        radial_gradient,  // Source: the gradient
-        NULL,             // Mask: no mask
-        image,            // Destination: the image
-        0, 0,             // Source origin
-        0, 0,             // Mask origin
-        cx - radius, cy - radius, // Destination origin
-        2 * radius, 2 * radius // Destination size (width and height)
-    );
-    
-    pixman_image_composite32(
-        PIXMAN_OP_OVER, 
-        radial_gradient2,  // Source: the gradient
-        NULL,             // Mask: no mask
-        image,            // Destination: the image
-        0, 0,             // Source origin
-        0, 0,             // Mask origin
-        cx - radius, cy - radius, // Destination origin
-        2 * radius, 2 * radius // Destination size (width and height)
-    );
-    
-    // Cleanup
-    pixman_image_unref(radial_gradient);
-    pixman_image_unref(radial_gradient2);
+  if (painting) {
+    dim_buffers_prune();
+    TRACE_END(TRACE_PAINT, count, 0);
+  }
 }
 
-static void render(struct output *output) {
-  if (!output->frame_done) {
-    output->wants_render = true;
-    return; // Skip rendering if the previous frame isn't done
-  }
-  //
-  // If the output is not the current output and has already been rendered
-  // without the cursor, skip rendering
-  if (output != current_output && output->rendered_without_cursor) {
-    return;
+static void output_hide(struct output *output) {
+  if (subsurface_mode) {
+    // Also rasterizes the sprite, if needed
+    if (!subsurfaces_setup(output)) {
+      LOG_ERR("failed to set up subsurfaces");
+      return;
+    }
+    subsurface_place(&output->halo, NULL, 0, 0, 0, 0);
+    for (size_t i = 0; i < DIM_COUNT; i++)
+      subsurface_place(&output->dim[i], NULL, 0, 0, 0, 0);
+  } else {
+    if (output->viewport == NULL)
+      output->viewport = wp_viewporter_get_viewport(viewporter, output->surf);
+    wl_surface_set_buffer_scale(output->surf, 1);
+    wl_surface_attach(output->surf, clear_pixel, 0, 0);
+    wp_viewport_set_destination(output->viewport, output->render_width,
+                                output->render_height);
+    wl_surface_damage_buffer(output->surf, 0, 0, INT32_MAX, INT32_MAX);
+
+    // Pre-warm the sprite, a buffer of our own and the shared dim buffer,
+    // which render_flush() keeps back
+    if (!cursor_mode) {
+      render_halo_sprite(RADIUS, output_scale120(output));
+      paint_prewarm(output);
+      output->paint_pending = true;
+    }
   }
 
-  const int width = output->render_width;
-  const int height = output->render_height;
-  const int scale = output->scale;
+  wl_surface_set_input_region(output->surf, empty_region);
+  wl_surface_commit(output->surf);
 
-  struct buffer *buf =
-      shm_get_buffer(shm, width * scale, height * scale, (uintptr_t)output);
+  // Damage everything on the first frame after showing
+  output->damage_all = true;
+  output->shows_halo = false;
+  output->rendered_without_cursor = true;
+}
 
-  if (!buf)
+static void set_visible(bool show) {
+  if (visible == show)
     return;
-  
-  output->frame_done = false;
-
-  pixman_image_t *src = fill;
-  pixman_image_composite32(PIXMAN_OP_SRC, src, NULL, buf->pix, 0, 0, 0, 0, 0, 0,
-                           width * scale, height * scale);
 
-  wl_surface_set_buffer_scale(output->surf, scale);
-  wl_surface_attach(output->surf, buf->wl_buf, 0, 0);
-  // Draw the circle only on the current output
-  wl_surface_damage_buffer(output->surf, (output->last_x - RADIUS - 1) * scale,
-                           (output->last_y - RADIUS - 1) * scale, (RADIUS +1) * 2 * scale,
-                           (RADIUS +1) * 2 * scale);
-  if (output->last_x == 0 && output->last_y == 0) {
-    wl_surface_damage_buffer(output->surf, 0, 0, width * scale, height * scale);
-  }
-  if (output == current_output) {
-    output->last_x = cursor_x;
-    output->last_y = cursor_y;
-    
-    
-    
-    if (false) draw_circle(buf->pix, cursor_x * scale, cursor_y * scale, RADIUS * scale);
-    //draw_circle(buf->pix, cursor_x * scale, cursor_y * scale, 40 * scale);
-    draw_circle_with_gradient(buf->pix, cursor_x * scale, cursor_y * scale, RADIUS * scale);
-    wl_surface_damage_buffer(output->surf, (cursor_x - RADIUS - 1) * scale,
-                             (cursor_y - RADIUS - 1) * scale, (RADIUS + 1) * 2 * scale, (RADIUS + 1) * 2 * scale);
-    output->rendered_without_cursor =
-        false; // Reset the flag as we're rendering the cursor
+  LOG_DBG("%s", show ? "showing" : "hiding");
+  visible = show;
+  if (!show) {
+    current_output = NULL;
+    capture_forget();
   } else {
-    output->rendered_without_cursor =
-        true; // Set the flag since the output is rendered without the cursor
+    pulse_started = pulse_settled = false;
   }
 
-  // Create a callback to know when the frame is done
-  struct wl_callback *callback = wl_surface_frame(output->surf);
-  wl_callback_add_listener(callback, &frame_listener,
-                           output); // Pass output as data
-
-  wl_surface_commit(output->surf);
+  tll_foreach(outputs, it) {
+    struct output *output = &it->item;
+    if (!output->configured)
+      continue;
+
+    // Applied by the commit of the first frame
+    if (show)
+      wl_surface_set_input_region(output->surf, NULL);
+    output->rendered_without_cursor = false;
+    render(output);
+  }
 }
 
 static void layer_surface_configure(void *data,
@@ -273,14 +1614,22 @@ static void layer_surface_configure(void *data,
     wl_surface_commit(output->surf);
     return;
   }
-  // TODO: (Re)-Create double buffers
   output->render_width = w;
   output->render_height = h;
   output->configured = true;
+  output->rendered_without_cursor = false;
   render(output);
 }
 
 static void output_layer_destroy(struct output *output) {
+  tll_foreach(output->feedbacks, it) frame_feedback_destroy(it->item);
+  subsurfaces_destroy(output);
+  if (output->fractional_scale != NULL)
+    wp_fractional_scale_v1_destroy(output->fractional_scale);
+  output->fractional_scale = NULL;
+  shm_swapchain_destroy(output->chain);
+  output->chain = NULL;
+
   if (output->layer != NULL)
     zwlr_layer_surface_v1_destroy(output->layer);
   if (output->surf != NULL)
@@ -313,6 +1662,10 @@ static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
 static void output_destroy(struct output *output) {
   output_layer_destroy(output);
 
+  if (output->xdg_output != NULL)
+    zxdg_output_v1_destroy(output->xdg_output);
+  output->xdg_output = NULL;
+
   if (output->wl_output != NULL)
     wl_output_release(output->wl_output);
   output->wl_output = NULL;
@@ -333,6 +1686,7 @@ static void output_geometry(void *data, struct wl_output *wl_output, int32_t x,
 
   output->make = make != NULL ? strdup(make) : NULL;
   output->model = model != NULL ? strdup(model) : NULL;
+  output->transform = transform;
 }
 
 static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
@@ -359,9 +1713,79 @@ static void output_scale(void *data, struct wl_output *wl_output,
                          int32_t factor) {
   struct output *output = data;
   output->scale = factor;
+  render_prune_sprites(scale_in_use);
+
+  if (cursor_mode && output == current_output)
+    cursor_paint(output_scale120(output));
 
-  if (output->configured)
+  if (output->configured) {
+    output->rendered_without_cursor = false;
     render(output);
+  }
+}
+
+static void fractional_scale_preferred_scale(
+    void *data, struct wp_fractional_scale_v1 *wp_fractional_scale_v1,
+    uint32_t scale) {
+  struct output *output = data;
+  if (output->preferred_scale == scale)
+    return;
+
+  LOG_DBG("preferred scale: %.3f", scale / 120.);
+  output->preferred_scale = scale;
+  render_prune_sprites(scale_in_use);
+
+  if (cursor_mode && output == current_output)
+    cursor_paint(output_scale120(output));
+
+  if (output->configured) {
+    output->rendered_without_cursor = false;
+    render(output);
+  }
+}
+
+static const struct wp_fractional_scale_v1_listener fractional_scale_listener = {
+    .preferred_scale = &fractional_scale_preferred_scale,
+};
+
+static void xdg_output_logical_position(void *data,
+                                        struct zxdg_output_v1 *xdg_output,
+                                        int32_t x, int32_t y) {
+  struct output *output = data;
+  output->logical_x = x;
+  output->logical_y = y;
+  output->has_layout = true;
+}
+
+static void xdg_output_logical_size(void *data,
+                                    struct zxdg_output_v1 *xdg_output,
+                                    int32_t width, int32_t height) {}
+
+static void xdg_output_done(void *data, struct zxdg_output_v1 *xdg_output) {}
+
+static void xdg_output_name(void *data, struct zxdg_output_v1 *xdg_output,
+                            const char *name) {}
+
+static void xdg_output_description(void *data,
+                                   struct zxdg_output_v1 *xdg_output,
+                                   const char *description) {}
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+    .logical_position = &xdg_output_logical_position,
+    .logical_size = &xdg_output_logical_size,
+    .done = &xdg_output_done,
+    .name = &xdg_output_name,
+    .description = &xdg_output_description,
+};
+
+static void output_layout_init(struct output *output) {
+  if (xdg_output_manager == NULL || output->xdg_output != NULL)
+    return;
+
+  output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+      xdg_output_manager, output->wl_output);
+  zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener,
+                              output);
 }
 
 static const struct wl_output_listener output_listener = {
@@ -404,27 +1828,141 @@ static void add_surface_to_output(struct output *output) {
   output->surf = surf;
   output->layer = layer;
 
+  if (fractional_scale_manager != NULL) {
+    output->fractional_scale =
+        wp_fractional_scale_manager_v1_get_fractional_scale(
+            fractional_scale_manager, surf);
+    wp_fractional_scale_v1_add_listener(output->fractional_scale,
+                                        &fractional_scale_listener, output);
+  }
+
   zwlr_layer_surface_v1_add_listener(layer, &layer_surface_listener, output);
   wl_surface_commit(surf);
 }
 
+/*
+ * Pointer events are grouped by wl_pointer.frame (seat v5+). Motion only
+ * records the latest position and each group is rendered once; render()
+ * itself defers to the next frame callback. An output is therefore painted
+ * at most once per refresh, whatever the polling rate of the device.
+ */
+static bool pointer_dirty = false;
+
+static struct {
+  unsigned long motion_events;
+  unsigned long motion_frames;
+} input_stats;
+
+static void pointer_flush(void) {
+  if (!pointer_dirty)
+    return;
+
+  pointer_dirty = false;
+  input_stats.motion_frames++;
+
+  // The compositor moves the cursor, and the halo with it
+  if (cursor_mode)
+    return;
+
+  // Redraw the surface when the cursor moves
+  tll_foreach(outputs, it) render(&it->item);
+}
+
+static void pointer_changed(struct wl_pointer *pointer) {
+  pointer_dirty = true;
+
+  // Without frame events, every event is its own group
+  if (wl_pointer_get_version(pointer) < WL_POINTER_FRAME_SINCE_VERSION)
+    pointer_flush();
+}
+
 static void pointer_motion(void *data, struct wl_pointer *pointer,
                            uint32_t time, wl_fixed_t surface_x,
                            wl_fixed_t surface_y) {
   cursor_x = wl_fixed_to_int(surface_x);
   cursor_y = wl_fixed_to_int(surface_y);
-  LOG_DBG("%u %u", cursor_x, cursor_y);
+  TRACE(TRACE_POINTER_MOTION, cursor_x, cursor_y);
 
-  // Redraw the surface when the cursor moves
-  tll_foreach(outputs, it) render(&it->item);
+  predict_add(&predictor, time, wl_fixed_to_double(surface_x),
+              wl_fixed_to_double(surface_y));
+
+  if (!input_pending) {
+    input_pending = true;
+    input_time = time;
+  }
+
+  input_stats.motion_events++;
+  pointer_changed(pointer);
+}
+
+/* The cursor image for outputs of 'scale120', if it isn't already */
+static bool cursor_paint(int scale120) {
+  if (cursor_buf != NULL && cursor_scale120 == scale120)
+    return true;
+
+  const int r = scale_to_px(RADIUS, scale120);
+  struct buffer *buf = shm_create_buffer(shm, 2 * r, 2 * r);
+  if (buf == NULL)
+    return false;
+
+  // Our SHM buffers are ARGB8888, but mhalo's own frames ignore the alpha
+  pixman_image_t *pix = pixman_image_create_bits_no_clear(
+      PIXMAN_a8r8g8b8, buf->width, buf->height, buf->mmapped, buf->stride);
+  if (pix == NULL) {
+    LOG_ERR("failed to create pixman image");
+    shm_destroy_buffer(buf);
+    return false;
+  }
+  render_halo_glow(pix, RADIUS, scale120);
+
+  const char *env = getenv("XCURSOR_SIZE");
+  int size = env != NULL ? atoi(env) : 0;
+  if (size <= 0)
+    size = CURSOR_SIZE_DEFAULT;
+
+  struct xcursor_image image;
+  const int px = scale_to_px(size, scale120);
+  if (xcursor_load(&image, NULL, "default", px) ||
+      xcursor_load(&image, NULL, "left_ptr", px)) {
+    pixman_image_t *arrow =
+        pixman_image_create_bits(PIXMAN_a8r8g8b8, image.width, image.height,
+                                 image.pixels, image.width * sizeof(uint32_t));
+    if (arrow != NULL) {
+      pixman_image_composite32(PIXMAN_OP_OVER, arrow, NULL, pix, 0, 0, 0, 0,
+                               r - image.hot_x, r - image.hot_y, image.width,
+                               image.height);
+      pixman_image_unref(arrow);
+    }
+    xcursor_image_free(&image);
+  } else {
+    LOG_WARN("no cursor theme found, the cursor is just the halo");
+  }
+  pixman_image_unref(pix);
+
+  // Replace the old image before freeing it; 1:1 to physical pixels
+  if (cursor_viewport == NULL)
+    cursor_viewport = wp_viewporter_get_viewport(viewporter, cursor_surf);
+  wl_surface_attach(cursor_surf, buf->wl_buf, 0, 0);
+  wl_surface_set_buffer_scale(cursor_surf, 1);
+  wp_viewport_set_destination(cursor_viewport, 2 * RADIUS, 2 * RADIUS);
+  wl_surface_damage_buffer(cursor_surf, 0, 0, INT32_MAX, INT32_MAX);
+  wl_surface_commit(cursor_surf);
+
+  shm_destroy_buffer(cursor_buf);
+  cursor_buf = buf;
+  cursor_scale120 = scale120;
+  return true;
 }
 
 static void pointer_enter(void *data, struct wl_pointer *pointer,
                           uint32_t serial, struct wl_surface *surface,
                           wl_fixed_t surface_x, wl_fixed_t surface_y) {
-  LOG_DBG("ENTER");
   cursor_x = wl_fixed_to_int(surface_x);
   cursor_y = wl_fixed_to_int(surface_y);
+  TRACE(TRACE_POINTER_ENTER, cursor_x, cursor_y);
+
+  // Positions on another surface do not extrapolate
+  predict_reset(&predictor);
 
   tll_foreach(outputs, it) {
     if (it->item.surf == surface) {
@@ -432,27 +1970,48 @@ static void pointer_enter(void *data, struct wl_pointer *pointer,
       break;
     }
   }
-  render(current_output);
+
+  // The hotspot is the center of the halo
+  if (cursor_mode &&
+      cursor_paint(current_output != NULL ? output_scale120(current_output)
+                                          : 120))
+    wl_pointer_set_cursor(pointer, serial, cursor_surf, RADIUS, RADIUS);
+
+  pointer_changed(pointer);
 }
 
 static void pointer_leave(void *data, struct wl_pointer *pointer,
                           uint32_t serial, struct wl_surface *surface) {
+  TRACE(TRACE_POINTER_LEAVE, 0, 0);
+
   // When the pointer leaves the current output, set current_output to NULL
   current_output = NULL;
 }
 
+// A click or scroll dismisses the overlay
+static void dismiss(void) {
+  if (daemon_mode)
+    set_visible(false);
+  else
+    should_exit = true;
+}
+
 static void pointer_button(void *data, struct wl_pointer *wl_pointer,
                            uint32_t serial, uint32_t time, uint32_t button,
                            uint32_t state) {
-  should_exit = true;
+  TRACE(TRACE_POINTER_BUTTON, button, state);
+  dismiss();
 }
 
 static void pointer_axis(void *data, struct wl_pointer *wl_pointer,
                          uint32_t time, uint32_t axis, wl_fixed_t value) {
-  should_exit = true;
+  dismiss();
 }
 
-static void pointer_frame(void *data, struct wl_pointer *wl_pointer) {}
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer) {
+  TRACE(TRACE_POINTER_FRAME, 0, 0);
+  pointer_flush();
+}
 
 static void pointer_axis_source(void *data, struct wl_pointer *wl_pointer,
                                 uint32_t axis_source) {}
@@ -462,7 +2021,7 @@ static void pointer_axis_stop(void *data, struct wl_pointer *wl_pointer,
 
 static void pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer,
                                   uint32_t axis, int32_t discrete) {
-  should_exit = true;
+  dismiss();
 }
 
 struct wl_pointer_listener pointer_listener = {
@@ -542,9 +2101,29 @@ static void handle_global(void *data, struct wl_registry *registry,
 
     struct output *output = &tll_back(outputs);
     wl_output_add_listener(wl_output, &output_listener, output);
+    output_layout_init(output);
     add_surface_to_output(output);
   }
 
+  else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    xdg_output_manager = wl_registry_bind(
+        registry, name, &zxdg_output_manager_v1_interface, required);
+    tll_foreach(outputs, it) output_layout_init(&it->item);
+  }
+
+  else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    screencopy_manager = wl_registry_bind(
+        registry, name, &zwlr_screencopy_manager_v1_interface, required);
+  }
+
   else if (strcmp(interface, zwlr_layer_shell_v1_interface.name) == 0) {
     const uint32_t required = 2;
     if (!verify_iface_version(interface, version, required))
@@ -552,8 +2131,59 @@ static void handle_global(void *data, struct wl_registry *registry,
 
     layer_shell = wl_registry_bind(registry, name,
                                    &zwlr_layer_shell_v1_interface, required);
+  }
+
+  else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    subcompositor = wl_registry_bind(registry, name,
+                                     &wl_subcompositor_interface, required);
+  }
+
+  else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    viewporter =
+        wl_registry_bind(registry, name, &wp_viewporter_interface, required);
+  }
+
+  else if (strcmp(interface,
+                  wp_fractional_scale_manager_v1_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    fractional_scale_manager = wl_registry_bind(
+        registry, name, &wp_fractional_scale_manager_v1_interface, required);
+  }
+
+  else if (strcmp(interface,
+                  wp_single_pixel_buffer_manager_v1_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    single_pixel_manager = wl_registry_bind(
+        registry, name, &wp_single_pixel_buffer_manager_v1_interface, required);
+  }
+
+  else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+    const uint32_t required = 1;
+    if (!verify_iface_version(interface, version, required))
+      return;
+
+    presentation =
+        wl_registry_bind(registry, name, &wp_presentation_interface, required);
+    wp_presentation_add_listener(presentation, &presentation_listener, NULL);
   } else if (strcmp(interface, wl_seat_interface.name) == 0) {
-    seat = wl_registry_bind(registry, name, &wl_seat_interface, 1);
+    // v5 for wl_pointer.frame, used to coalesce motion
+    const uint32_t wanted = 5;
+    seat = wl_registry_bind(registry, name, &wl_seat_interface,
+                            version < wanted ? version : wanted);
     wl_seat_add_listener(seat, &seat_listener, NULL);
   }
 }
@@ -563,8 +2193,13 @@ static void handle_global_remove(void *data, struct wl_registry *registry,
   tll_foreach(outputs, it) {
     if (it->item.wl_name == name) {
       LOG_DBG("destroyed: %s %s", it->item.make, it->item.model);
+      if (current_output == &it->item)
+        current_output = NULL;
+      if (capture.output == &it->item)
+        capture_forget();
       output_destroy(&it->item);
       tll_remove(outputs, it);
+      render_prune_sprites(scale_in_use);
       return;
     }
   }
@@ -575,12 +2210,54 @@ static const struct wl_registry_listener registry_listener = {
     .global_remove = &handle_global_remove,
 };
 
+static bool show_stats = false;
+
+static void log_render_stats(void) {
+  LOG_INFO("pointer: %lu motion events in %lu frames", input_stats.motion_events,
+           input_stats.motion_frames);
+
+  tll_foreach(outputs, it) {
+    const struct output *output = &it->item;
+    LOG_INFO("output: %s %s: %lu frames rendered, %lu redraws coalesced",
+             output->make, output->model, output->frame, output->coalesced);
+
+    char name[128];
+    snprintf(name, sizeof(name), "output: %s %s", output->make,
+             output->model);
+    if (show_stats)
+      stats_output_log(&output->stats, name);
+    if (presentation != NULL)
+      latency_log(&output->latency, name);
+  }
+
+  if (show_stats)
+    shm_log_stats();
+}
+
 static void usage(const char *progname) {
   printf("Usage: %s [OPTIONS] \n"
          "\n"
          "Options:\n"
-         "  -v,--version     show the version number and quit\n",
-         progname);
+         "  -c,--cursor          draw the halo into the cursor image, with a\n"
+         "                       static dim layer\n"
+         "  -d,--daemon          stay running hidden, SIGUSR1 shows and hides\n"
+         "     --deadline[=MS]   paint MS ms before the next refresh instead of\n"
+         "                       right away (default: %d)\n"
+         "     --magnify[=N]     show what is under the pointer N times larger\n"
+         "                       inside the halo, 2 to %d (default: %d), once\n"
+         "                       the pointer rests\n"
+         "  -m,--max-memory=MIB  cap the SHM memory used for buffers\n"
+         "  -p,--predict=MS      draw the halo where the pointer will be MS ms\n"
+         "                       after painting (default: measured latency)\n"
+         "     --no-predict      draw the halo at the last reported position\n"
+         "     --pulse           shrink the halo onto the pointer, then pulse\n"
+         "     --stats           log paint times, skipped frames and SHM use\n"
+         "                       on exit and on SIGUSR2\n"
+         "  -s,--subsurface      move a pre-rendered halo instead of redrawing\n"
+         "  -t,--threads=N       render with N threads, 0 for one per CPU "
+         "(default: 1)\n"
+         "  -v,--version         show the version number and quit\n",
+         progname, DEADLINE_DEFAULT_MS, MAGNIFY_MAX, MAGNIFY_DEFAULT);
 }
 
 static const char *version_and_features(void) {
@@ -591,19 +2268,127 @@ static const char *version_and_features(void) {
 
 int main(int argc, char *const *argv) {
   const char *progname = argv[0];
+  long threads = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  trace_init();
 
   const struct option longopts[] = {
+      {"cursor", no_argument, 0, 'c'},
+      {"daemon", no_argument, 0, 'd'},
+      {"deadline", optional_argument, 0, 'D'},
+      {"magnify", optional_argument, 0, 'z'},
+      {"max-memory", required_argument, 0, 'm'},
+      {"predict", required_argument, 0, 'p'},
+      {"pulse", no_argument, 0, 'u'},
+      {"no-predict", no_argument, 0, 'P'},
+      {"stats", no_argument, 0, 'S'},
+      {"subsurface", no_argument, 0, 's'},
+      {"threads", required_argument, 0, 't'},
       {"version", no_argument, 0, 'v'},
       {"help", no_argument, 0, 'h'},
       {NULL, no_argument, 0, 0},
   };
 
   while (true) {
-    int c = getopt_long(argc, argv, "vh", longopts, NULL);
+    int c = getopt_long(argc, argv, "cdm:p:st:vh", longopts, NULL);
     if (c < 0)
       break;
 
     switch (c) {
+    case 'c':
+      cursor_mode = true;
+      break;
+
+    case 'd':
+      daemon_mode = true;
+      visible = false;
+      break;
+
+    case 'D': {
+      if (optarg == NULL) {
+        deadline_slack_ms = DEADLINE_DEFAULT_MS;
+        break;
+      }
+
+      char *end;
+      errno = 0;
+      long ms = strtol(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || ms < 0 || ms > 100) {
+        fprintf(stderr, "error: --deadline: invalid time: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      deadline_slack_ms = ms;
+      break;
+    }
+
+    case 'z': {
+      if (optarg == NULL) {
+        magnify = MAGNIFY_DEFAULT;
+        break;
+      }
+
+      char *end;
+      errno = 0;
+      long factor = strtol(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || factor < 2 || factor > MAGNIFY_MAX) {
+        fprintf(stderr, "error: --magnify: invalid factor: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      magnify = factor;
+      break;
+    }
+
+    case 'm': {
+      char *end;
+      errno = 0;
+      unsigned long mib = strtoul(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || mib > SIZE_MAX / (1024 * 1024)) {
+        fprintf(stderr, "error: -m: invalid size: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      shm_set_memory_limit(mib * 1024 * 1024);
+      break;
+    }
+
+    case 'p': {
+      char *end;
+      errno = 0;
+      long ms = strtol(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || ms < 0 || ms > 1000) {
+        fprintf(stderr, "error: -p: invalid prediction horizon: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      predict_horizon = ms;
+      break;
+    }
+
+    case 'P':
+      predict_horizon = 0;
+      break;
+
+    case 'u':
+      pulse_mode = true;
+      break;
+
+    case 'S':
+      show_stats = true;
+      break;
+
+    case 's':
+      subsurface_mode = true;
+      break;
+
+    case 't': {
+      char *end;
+      errno = 0;
+      threads = strtol(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || threads < 0) {
+        fprintf(stderr, "error: -t: invalid thread count: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
 
     case 'v':
       printf("mhalo version: %s\n", version_and_features());
@@ -623,19 +2408,24 @@ int main(int argc, char *const *argv) {
     }
   }
 
-  stretch = (argc == 3);
-
   setlocale(LC_CTYPE, "");
   log_init(LOG_COLORIZE_AUTO, false, LOG_FACILITY_DAEMON, LOG_CLASS_WARNING);
 
   LOG_INFO("%s", WBG_VERSION);
 
-  pixman_color_t black = {0, 0, 0, 0xbfff};
-  fill = pixman_image_create_solid_fill(&black);
+  if (!render_init(&dim_color)) {
+    LOG_ERR("failed to initialize the renderer");
+    return EXIT_FAILURE;
+  }
 
   int exit_code = EXIT_FAILURE;
   int sig_fd = -1;
 
+  if (threads == 0)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > 1 && !workers_init(threads - 1))
+    LOG_WARN("rendering on the main thread only");
+
   display = wl_display_connect(NULL);
   if (display == NULL) {
     LOG_ERR("failed to connect to wayland; no compositor running?");
@@ -663,6 +2453,46 @@ int main(int argc, char *const *argv) {
     LOG_ERR("no layer shell interface");
     goto out;
   }
+  if (cursor_mode && viewporter == NULL) {
+    LOG_WARN("cursor mode needs wp_viewporter, falling back to full redraws");
+    cursor_mode = false;
+  }
+  if (cursor_mode && (subsurface_mode || pulse_mode)) {
+    LOG_WARN("the halo is in the cursor, ignoring --subsurface and --pulse");
+    subsurface_mode = pulse_mode = false;
+  }
+  if (subsurface_mode && (subcompositor == NULL || viewporter == NULL)) {
+    LOG_WARN("subsurface mode needs wl_subcompositor and wp_viewporter, "
+             "falling back to full redraws");
+    subsurface_mode = false;
+  }
+  if (subsurface_mode && pulse_mode) {
+    LOG_WARN("the pulse animation needs full redraws, disabling it");
+    pulse_mode = false;
+  }
+  if (magnify > 0 && screencopy_manager == NULL) {
+    LOG_WARN("the magnifier needs zwlr_screencopy_manager_v1, disabling it");
+    magnify = 0;
+  }
+  if (magnify > 0 && (subsurface_mode || cursor_mode)) {
+    LOG_WARN("the magnifier needs full redraws, disabling it");
+    magnify = 0;
+  }
+  if (daemon_mode && viewporter == NULL) {
+    LOG_ERR("daemon mode needs wp_viewporter");
+    goto out;
+  }
+  if ((subsurface_mode || daemon_mode || cursor_mode) &&
+      !pixel_buffers_create()) {
+    LOG_ERR("failed to create the dim layer buffers");
+    goto out;
+  }
+
+  if (cursor_mode)
+    cursor_surf = wl_compositor_create_surface(compositor);
+
+  if (daemon_mode)
+    empty_region = wl_compositor_create_region(compositor);
 
   tll_foreach(outputs, it) add_surface_to_output(&it->item);
 
@@ -673,10 +2503,30 @@ int main(int argc, char *const *argv) {
     goto out;
   }
 
+  if (deadline_slack_ms >= 0 && presentation == NULL) {
+    LOG_WARN("deadline scheduling needs wp_presentation, painting right away");
+  } else if (deadline_slack_ms >= 0) {
+    sched_fd =
+        timerfd_create(presentation_clock, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (sched_fd < 0)
+      LOG_ERRNO("failed to create the frame timer, painting right away");
+  }
+
+  if (magnify > 0) {
+    capture_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (capture_fd < 0) {
+      LOG_ERRNO("failed to create the magnifier timer, disabling it");
+      magnify = 0;
+    }
+  }
+
   sigset_t mask;
   sigemptyset(&mask);
   sigaddset(&mask, SIGINT);
   sigaddset(&mask, SIGQUIT);
+  sigaddset(&mask, SIGUSR2);
+  if (daemon_mode)
+    sigaddset(&mask, SIGUSR1);
 
   sigprocmask(SIG_BLOCK, &mask, NULL);
 
@@ -686,11 +2536,14 @@ int main(int argc, char *const *argv) {
   }
 
   while (true) {
+    render_flush();
     wl_display_flush(display);
 
     struct pollfd fds[] = {
         {.fd = wl_display_get_fd(display), .events = POLLIN},
         {.fd = sig_fd, .events = POLLIN},
+        {.fd = sched_fd, .events = POLLIN},   // ignored if -1
+        {.fd = capture_fd, .events = POLLIN}, // ignored if -1
     };
     int ret = poll(fds, sizeof(fds) / sizeof(fds[0]), -1);
 
@@ -714,6 +2567,12 @@ int main(int argc, char *const *argv) {
       }
     }
 
+    if (fds[2].revents & POLLIN)
+      schedule_expired();
+
+    if (fds[3].revents & POLLIN)
+      capture_rested();
+
     if (fds[1].revents & POLLHUP)
       abort();
 
@@ -729,11 +2588,19 @@ int main(int argc, char *const *argv) {
       }
 
       assert(count == sizeof(info));
-      assert(info.ssi_signo == SIGINT || info.ssi_signo == SIGQUIT);
 
-      LOG_INFO("goodbye");
-      exit_code = EXIT_SUCCESS;
-      break;
+      if (info.ssi_signo == SIGUSR2) {
+        log_render_stats();
+        trace_dump();
+      } else if (info.ssi_signo == SIGUSR1)
+        set_visible(!visible);
+      else {
+        assert(info.ssi_signo == SIGINT || info.ssi_signo == SIGQUIT);
+
+        LOG_INFO("goodbye");
+        exit_code = EXIT_SUCCESS;
+        break;
+      }
     }
     
     if (should_exit) {
@@ -743,13 +2610,36 @@ int main(int argc, char *const *argv) {
     }
   }
 
+  // SIGUSR2 asks for the summaries; on exit only --stats does
+  if (show_stats)
+    log_render_stats();
+  trace_dump();
+
 out:
 
   if (sig_fd >= 0)
     close(sig_fd);
+  if (sched_fd >= 0)
+    close(sched_fd);
+  if (capture_fd >= 0)
+    close(capture_fd);
+
+  workers_fini();
+  free(paint_jobs);
 
+  capture_reset();
   tll_foreach(outputs, it) output_destroy(&it->item);
   tll_free(outputs);
+  tll_foreach(dim_buffers, it) shm_destroy_buffer(it->item);
+  tll_free(dim_buffers);
+  if (cursor_viewport != NULL)
+    wp_viewport_destroy(cursor_viewport);
+  if (cursor_surf != NULL)
+    wl_surface_destroy(cursor_surf);
+  shm_destroy_buffer(cursor_buf);
+  pixel_buffers_destroy();
+  if (empty_region != NULL)
+    wl_region_destroy(empty_region);
   
   if (pointer != NULL)
     wl_pointer_destroy(pointer);
@@ -757,6 +2647,20 @@ out:
     wl_seat_destroy(seat);
   if (layer_shell != NULL)
     zwlr_layer_shell_v1_destroy(layer_shell);
+  if (presentation != NULL)
+    wp_presentation_destroy(presentation);
+  if (xdg_output_manager != NULL)
+    zxdg_output_manager_v1_destroy(xdg_output_manager);
+  if (screencopy_manager != NULL)
+    zwlr_screencopy_manager_v1_destroy(screencopy_manager);
+  if (fractional_scale_manager != NULL)
+    wp_fractional_scale_manager_v1_destroy(fractional_scale_manager);
+  if (single_pixel_manager != NULL)
+    wp_single_pixel_buffer_manager_v1_destroy(single_pixel_manager);
+  if (viewporter != NULL)
+    wp_viewporter_destroy(viewporter);
+  if (subcompositor != NULL)
+    wl_subcompositor_destroy(subcompositor);
   if (shm != NULL)
     wl_shm_destroy(shm);
   if (compositor != NULL)
@@ -765,8 +2669,7 @@ out:
     wl_registry_destroy(registry);
   if (display != NULL)
     wl_display_disconnect(display);
-  if (fill != NULL)
-    pixman_image_unref(fill);
+  render_fini();
   log_deinit();
   return exit_code;
 }
@@ -0,0 +1,187 @@
+#include "memfd.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LOG_MODULE "memfd"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+#if !defined(MFD_NOEXEC_SEAL)
+#define MFD_NOEXEC_SEAL 0
+#endif
+
+#if !defined(MADV_POPULATE_WRITE)
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/*
+ * Normal pages are still huge-page friendly: large mappings are sized in
+ * 2 MiB steps and advised for transparent huge pages, which shmem uses
+ * when /sys/kernel/mm/transparent_hugepage/shmem_enabled allows it.
+ */
+#define THP_SIZE (2 * 1024 * 1024)
+
+static size_t round_up(size_t size, size_t align) {
+  return (size + align - 1) / align * align;
+}
+
+static size_t mapping_size(const struct memfd_map *m, size_t size) {
+  if (m->huge)
+    return round_up(size, m->page_size);
+  if (size >= THP_SIZE)
+    return round_up(size, THP_SIZE);
+  return round_up(size, m->page_size);
+}
+
+static int create_fd(const char *name, unsigned extra) {
+  int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING |
+                                  MFD_NOEXEC_SEAL | extra);
+  if (fd < 0 && errno == EINVAL && MFD_NOEXEC_SEAL != 0)
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | extra);
+  return fd;
+}
+
+static bool map(struct memfd_map *m, size_t size) {
+  const size_t mapped = mapping_size(m, size);
+
+  if (ftruncate(m->fd, mapped) < 0)
+    return false;
+
+  // Reserves the huge pages, so this fails cleanly when there are none
+  void *mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                   MAP_SHARED |
+                       ((m->flags & MEMFD_PREFAULT) ? MAP_POPULATE : 0),
+                   m->fd, 0);
+  if (mem == MAP_FAILED)
+    return false;
+
+  if (!m->huge && mapped >= THP_SIZE)
+    madvise(mem, mapped, MADV_HUGEPAGE);
+
+  m->mem = mem;
+  m->size = mapped;
+  return true;
+}
+
+bool memfd_map_create(struct memfd_map *m, const char *name, size_t size,
+                      unsigned flags) {
+  *m = (struct memfd_map){
+      .fd = -1,
+      .mem = MAP_FAILED,
+      .page_size = sysconf(_SC_PAGESIZE),
+      .flags = flags,
+  };
+
+  if (flags & MEMFD_HUGETLB) {
+    m->fd = create_fd(name, MFD_HUGETLB);
+
+    // st_blksize of a hugetlbfs file is its huge page size
+    struct stat st;
+    if (m->fd >= 0 && fstat(m->fd, &st) == 0 && st.st_blksize > 0) {
+      m->huge = true;
+      m->page_size = st.st_blksize;
+      if (map(m, size)) {
+        LOG_DBG("%s: %zu bytes in %zu KiB huge pages", name, m->size,
+                m->page_size / 1024);
+        goto seal;
+      }
+    }
+
+    LOG_DBG("%s: no huge pages, falling back to normal pages", name);
+    if (m->fd >= 0)
+      close(m->fd);
+    m->huge = false;
+    m->page_size = sysconf(_SC_PAGESIZE);
+  }
+
+  m->fd = create_fd(name, 0);
+  if (m->fd < 0) {
+    LOG_ERRNO("failed to create SHM backing memory file");
+    return false;
+  }
+
+  if (!map(m, size)) {
+    LOG_ERRNO("failed to map %zu bytes of SHM backing memory", size);
+    close(m->fd);
+    m->fd = -1;
+    return false;
+  }
+
+seal:
+  // The file may grow later, but must never shrink under the compositor
+  if (fcntl(m->fd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+    LOG_ERRNO("failed to seal SHM backing memory file");
+
+  return true;
+}
+
+void memfd_map_destroy(struct memfd_map *m) {
+  if (m->mem != MAP_FAILED)
+    munmap(m->mem, m->size);
+  if (m->fd >= 0)
+    close(m->fd);
+
+  m->mem = MAP_FAILED;
+  m->fd = -1;
+}
+
+bool memfd_map_grow(struct memfd_map *m, size_t size) {
+  const size_t mapped = mapping_size(m, size);
+
+  if (ftruncate(m->fd, mapped) < 0) {
+    LOG_ERRNO("failed to grow SHM backing memory file");
+    return false;
+  }
+
+  void *mem = mremap(m->mem, m->size, mapped, MREMAP_MAYMOVE);
+  if (mem == MAP_FAILED) {
+    // Not every kernel can grow hugetlb mappings; map the file anew instead
+    mem = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (mem == MAP_FAILED) {
+      LOG_ERRNO("failed to remap SHM backing memory file");
+      return false;
+    }
+    munmap(m->mem, m->size);
+  }
+
+  if (!m->huge && mapped >= THP_SIZE)
+    madvise(mem, mapped, MADV_HUGEPAGE);
+
+  m->mem = mem;
+  m->size = mapped;
+  return true;
+}
+
+void memfd_prefault(const struct memfd_map *m, void *addr, size_t len) {
+  if (len == 0)
+    return;
+
+  // madvise() wants ranges aligned to the mapping's pages, huge or not
+  const size_t page = m->page_size;
+  const uintptr_t start = (uintptr_t)addr / page * page;
+  const uintptr_t end = round_up((uintptr_t)addr + len, page);
+
+  if (madvise((void *)start, end - start, MADV_POPULATE_WRITE) == 0)
+    return;
+
+  // EINVAL is how kernels before 5.14 reject the advice
+  if (errno != EINVAL) {
+    LOG_ERRNO("failed to prefault %zu bytes of SHM backing memory", len);
+    return;
+  }
+
+  /*
+   * Write to every page instead. Only bytes inside the range are touched,
+   * since the pages at either end may be shared with a neighboring buffer.
+   */
+  volatile uint8_t *p = addr;
+  for (size_t off = 0; off < len; off += page - ((uintptr_t)(p + off) % page))
+    p[off] = 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Shared memory for pixel buffers: a sealed memfd and its mapping. Nothing
+ * in here knows about Wayland, so the benchmark can measure the same
+ * allocation path as mhalo.
+ */
+
+enum memfd_flags {
+  MEMFD_HUGETLB = 1 << 0,  // try hugetlbfs pages first
+  MEMFD_PREFAULT = 1 << 1, // fault in all pages up front
+};
+
+struct memfd_map {
+  int fd;
+  void *mem;
+  size_t size;
+  size_t page_size;
+  bool huge; // backed by hugetlbfs
+  unsigned flags;
+};
+
+/*
+ * Map at least 'size' bytes; the size is rounded up to whole (huge) pages.
+ * Falls back to normal pages when no huge pages are available.
+ */
+bool memfd_map_create(struct memfd_map *m, const char *name, size_t size,
+                      unsigned flags);
+void memfd_map_destroy(struct memfd_map *m);
+
+/* Grow the file and the mapping; the mapping may move */
+bool memfd_map_grow(struct memfd_map *m, size_t size);
+
+/* Fault in the pages of [addr, addr + len), inside 'm', for writing */
+void memfd_prefault(const struct memfd_map *m, void *addr, size_t len);
@@ -0,0 +1,141 @@
+#include "predict.h"
+
+#include <math.h>
+
+#define LOG_MODULE "predict"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+// Samples older than this (relative to the newest) are not used
+#define WINDOW_MS 50
+// Without motion for this long the pointer is considered at rest
+#define IDLE_MS 20
+// Never extrapolate further than this past the newest sample
+#define MAX_MS 50
+// Acceleration needs samples spanning at least this much time
+#define ACCEL_SPAN_MS 8
+
+void predict_reset(struct predictor *p) { *p = (struct predictor){0}; }
+
+static const struct predict_sample *newest(const struct predictor *p) {
+  return &p->samples[(p->head + PREDICT_SAMPLES - 1) % PREDICT_SAMPLES];
+}
+
+void predict_add(struct predictor *p, uint32_t time, double x, double y) {
+  if (p->count > 0) {
+    struct predict_sample *last =
+        &p->samples[(p->head + PREDICT_SAMPLES - 1) % PREDICT_SAMPLES];
+    const int32_t dt = (int32_t)(time - last->time);
+
+    // Several events in the same millisecond: keep the latest position
+    if (dt == 0) {
+      last->x = x;
+      last->y = y;
+      return;
+    }
+
+    // Out of order, or a new stroke after a pause
+    if (dt < 0 || dt > WINDOW_MS)
+      predict_reset(p);
+  }
+
+  p->samples[p->head] = (struct predict_sample){time, x, y};
+  p->head = (p->head + 1) % PREDICT_SAMPLES;
+  if (p->count < PREDICT_SAMPLES)
+    p->count++;
+}
+
+/*
+ * Solve the normal equations of x(t) = c0 + c1 t + c2 t^2 for one axis.
+ * 's' holds the sums of t^0..t^4, 'sx' those of x t^0..x t^2.
+ */
+static bool fit_quadratic(const double s[5], const double sx[3], double *c1,
+                          double *c2) {
+  const double det = s[0] * (s[2] * s[4] - s[3] * s[3]) -
+                     s[1] * (s[1] * s[4] - s[3] * s[2]) +
+                     s[2] * (s[1] * s[3] - s[2] * s[2]);
+  if (fabs(det) < 1e-9)
+    return false;
+
+  *c1 = (s[0] * (sx[1] * s[4] - s[3] * sx[2]) -
+         sx[0] * (s[1] * s[4] - s[3] * s[2]) +
+         s[2] * (s[1] * sx[2] - sx[1] * s[2])) /
+        det;
+  *c2 = (s[0] * (s[2] * sx[2] - sx[1] * s[3]) -
+         s[1] * (s[1] * sx[2] - sx[1] * s[2]) +
+         sx[0] * (s[1] * s[3] - s[2] * s[2])) /
+        det;
+  return true;
+}
+
+static bool fit_linear(const double s[5], const double sx[3], double *c1) {
+  const double det = s[0] * s[2] - s[1] * s[1];
+  if (fabs(det) < 1e-9)
+    return false;
+
+  *c1 = (s[0] * sx[1] - s[1] * sx[0]) / det;
+  return true;
+}
+
+bool predict_position(const struct predictor *p, uint32_t now, int horizon,
+                      double *x, double *y) {
+  if (p->count < 2)
+    return false;
+
+  const struct predict_sample *last = newest(p);
+  const int32_t idle = (int32_t)(now - last->time);
+  if (idle > IDLE_MS)
+    return false;
+
+  // Times relative to the newest sample, so t <= 0
+  double s[5] = {0}, sx[3] = {0}, sy[3] = {0};
+  int32_t span = 0;
+  for (size_t i = 0; i < p->count; i++) {
+    const struct predict_sample *smp =
+        &p->samples[(p->head + PREDICT_SAMPLES - 1 - i) % PREDICT_SAMPLES];
+    const int32_t age = (int32_t)(last->time - smp->time);
+    if (age > WINDOW_MS)
+      break;
+
+    const double t = -age;
+    double tk = 1;
+    for (int k = 0; k < 5; k++, tk *= t) {
+      s[k] += tk;
+      if (k < 3) {
+        sx[k] += smp->x * tk;
+        sy[k] += smp->y * tk;
+      }
+    }
+    span = age;
+  }
+
+  double vx, vy, ax = 0, ay = 0;
+  if (s[0] < 3 || span < ACCEL_SPAN_MS || !fit_quadratic(s, sx, &vx, &ax) ||
+      !fit_quadratic(s, sy, &vy, &ay)) {
+    ax = ay = 0;
+    if (!fit_linear(s, sx, &vx) || !fit_linear(s, sy, &vy))
+      return false;
+  }
+
+  double dt = (idle > 0 ? idle : 0) + (horizon > 0 ? horizon : 0);
+  if (dt > MAX_MS)
+    dt = MAX_MS;
+
+  /*
+   * Relative to the newest raw position, so fitting noise in the constant
+   * term does not shift the halo. The acceleration term is limited to the
+   * size of the velocity term; it refines a flick but must not dominate
+   * when the pointer starts or stops.
+   */
+  double dx = vx * dt, dy = vy * dt;
+  double ddx = ax * dt * dt, ddy = ay * dt * dt;
+  if (fabs(ddx) > fabs(dx))
+    ddx = copysign(fabs(dx), ddx);
+  if (fabs(ddy) > fabs(dy))
+    ddy = copysign(fabs(dy), ddy);
+
+  *x = last->x + dx + ddx;
+  *y = last->y + dy + ddy;
+  LOG_DBG("%.0f ms ahead: %+.1f, %+.1f", dt, dx + ddx, dy + ddy);
+  return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Pointer motion extrapolation: a least-squares fit of position, velocity
+ * and acceleration over the motion events of the last few tens of
+ * milliseconds. Times are wl_pointer.motion timestamps, in milliseconds.
+ */
+
+#define PREDICT_SAMPLES 8
+
+struct predict_sample {
+  uint32_t time;
+  double x;
+  double y;
+};
+
+struct predictor {
+  struct predict_sample samples[PREDICT_SAMPLES];
+  size_t head; // next slot to write
+  size_t count;
+};
+
+void predict_reset(struct predictor *p);
+void predict_add(struct predictor *p, uint32_t time, double x, double y);
+
+/*
+ * Where the pointer will be 'horizon' ms after 'now'. Fails if there is not
+ * enough recent motion, e.g. when the pointer has stopped.
+ */
+bool predict_position(const struct predictor *p, uint32_t now, int horizon,
+                      double *x, double *y);
@@ -0,0 +1,517 @@
+#include "render.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tllist.h>
+
+#define LOG_MODULE "render"
+#include "kernel.h"
+#include "log.h"
+
+static pixman_image_t *fill = NULL;
+static uint32_t dim_pixel;
+static bool use_pixman = false;
+
+/*
+ * Fills of at least this many pixels use non-temporal stores. A full-frame
+ * fill is only read again by the compositor, so pulling it through the
+ * cache just evicts everything else.
+ */
+#define STREAM_THRESHOLD (256 * 1024)
+
+#define double_to_color(x)					\
+    (((uint32_t) ((x)*65536)) - (((uint32_t) ((x)*65536)) >> 16))
+
+#define PIXMAN_STOP(offset,r,g,b,a)		\
+    { pixman_double_to_fixed (offset),		\
+	{					\
+	double_to_color (r),			\
+	double_to_color (g),			\
+	double_to_color (b),			\
+	double_to_color (a)			\
+	}					\
+    }
+
+// Cut out of the dim layer with OUT_REVERSE
+static const pixman_gradient_stop_t halo_cut_stops[3] = {
+  PIXMAN_STOP (0.0,        1, 1, 1, 1),
+  PIXMAN_STOP (0.7,        1, 1, 1, 1),
+  PIXMAN_STOP (1.0,        0, 0, 0, 0),
+};
+
+// Painted OVER the cut
+static const pixman_gradient_stop_t halo_glow_stops[4] = {
+  PIXMAN_STOP (0.0,        1, 1, 1, 0.15),
+  PIXMAN_STOP (0.7,        1, 1, 1, 0.1),
+  PIXMAN_STOP (0.8,        1, 1, 0.31, 0.3),
+  PIXMAN_STOP (1.0,        0, 0, 0, 0),
+};
+
+static struct kernel_gradient halo_cut;
+static struct kernel_gradient halo_glow;
+
+static void draw_circle_with_gradient(pixman_image_t* image, int cx, int cy, int radius) {
+    // Define the points for the radial gradient
+    pixman_point_fixed_t inner_circle = { pixman_int_to_fixed(radius), pixman_int_to_fixed(radius) };
+    pixman_point_fixed_t outer_circle = { pixman_int_to_fixed(radius), pixman_int_to_fixed(radius) };
+    
+    pixman_fixed_t inner_radius = pixman_int_to_fixed(0);
+    pixman_fixed_t outer_radius = pixman_int_to_fixed(radius);
+    
+    // Create the gradient
+    pixman_image_t *radial_gradient = pixman_image_create_radial_gradient(
+        &inner_circle, &outer_circle,
+        inner_radius, outer_radius,
+        halo_cut_stops, 3
+    );
+    
+        // Create the gradient
+    pixman_image_t *radial_gradient2 = pixman_image_create_radial_gradient(
+        &inner_circle, &outer_circle,
+        inner_radius, outer_radius,
+        halo_glow_stops, 4
+    );
+    
+    // Set the gradient as the source and composite it onto the image
+    pixman_image_composite32(
+        PIXMAN_OP_OUT_REVERSE, 
+        radial_gradient,  // Source: the gradient
+        NULL,             // Mask: no mask
+        image,            // Destination: the image
+        0, 0,             // Source origin
+        0, 0,             // Mask origin
+        cx - radius, cy - radius, // Destination origin
+        2 * radius, 2 * radius // Destination size (width and height)
+    );
+    
+    pixman_image_composite32(
+        PIXMAN_OP_OVER, 
+        radial_gradient2,  // Source: the gradient
+        NULL,             // Mask: no mask
+        image,            // Destination: the image
+        0, 0,             // Source origin
+        0, 0,             // Mask origin
+        cx - radius, cy - radius, // Destination origin
+        2 * radius, 2 * radius // Destination size (width and height)
+    );
+    
+    // Cleanup
+    pixman_image_unref(radial_gradient);
+    pixman_image_unref(radial_gradient2);
+}
+
+static void kernel_gradient_from_pixman(struct kernel_gradient *g,
+                                        const pixman_gradient_stop_t *stops,
+                                        size_t count) {
+  g->count = count;
+  for (size_t i = 0; i < count; i++) {
+    g->stops[i] = (struct kernel_stop){
+        .offset = pixman_fixed_to_double(stops[i].x),
+        .a = stops[i].color.alpha / 65535.f,
+        .r = stops[i].color.red / 65535.f,
+        .g = stops[i].color.green / 65535.f,
+        .b = stops[i].color.blue / 65535.f,
+    };
+  }
+}
+
+// The kernels only handle 32-bit ARGB images
+static bool use_kernel(pixman_image_t *image) {
+  if (use_pixman)
+    return false;
+
+  const pixman_format_code_t format = pixman_image_get_format(image);
+  return format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8;
+}
+
+/*
+ * The halo always lands on the uniform dim color, so its final pixels only
+ * depend on the radius and scale. They are rasterized once into a cached
+ * sprite that is then copied with a single SRC blit, instead of evaluating
+ * both gradients for every frame. The sprite has the same format as our SHM
+ * buffers, making the copy byte-identical to drawing the gradients in place.
+ */
+struct halo_sprite {
+  int radius;
+  int scale120;
+  pixman_image_t *pix;
+};
+static tll(struct halo_sprite) halo_sprites;
+
+/*
+ * The pulse animation's halos, from the smallest to the largest radius, in
+ * one allocation. Each frame is a pixman image viewing its rows of the
+ * atlas, so it is blitted exactly like the static sprite.
+ */
+struct halo_atlas {
+  int radius_min;
+  int radius_max;
+  int count;
+  int scale120;
+  uint32_t *bits;
+  pixman_image_t *frames[RENDER_ATLAS_MAX_FRAMES];
+};
+static tll(struct halo_atlas) halo_atlases;
+
+// Rasterize a halo of radius 'r' into a 2r x 2r image
+static void halo_rasterize(pixman_image_t *pix, int r) {
+  if (use_kernel(pix)) {
+    kernel_halo(pixman_image_get_data(pix),
+                pixman_image_get_stride(pix) / sizeof(uint32_t), r, dim_pixel,
+                &halo_cut, &halo_glow);
+  } else {
+    render_dim(pix, 0, 0, 2 * r, 2 * r);
+    draw_circle_with_gradient(pix, r, r, r);
+  }
+}
+
+pixman_image_t *render_halo_sprite(int radius, int scale120) {
+  tll_foreach(halo_sprites, it) {
+    if (it->item.radius == radius && it->item.scale120 == scale120)
+      return it->item.pix;
+  }
+
+  const int r = scale_to_px(radius, scale120);
+  const int size = 2 * r;
+  pixman_image_t *pix =
+      pixman_image_create_bits(PIXMAN_x8r8g8b8, size, size, NULL, 0);
+  if (pix == NULL) {
+    LOG_ERR("failed to allocate %dx%d halo sprite", size, size);
+    return NULL;
+  }
+
+  halo_rasterize(pix, r);
+
+  tll_push_back(halo_sprites, ((struct halo_sprite){
+                                  .radius = radius,
+                                  .scale120 = scale120,
+                                  .pix = pix,
+                              }));
+  return pix;
+}
+
+void render_halo_glow(pixman_image_t *image, int radius, int scale120) {
+  const int r = scale_to_px(radius, scale120);
+
+  // With nothing to cut out of, only the glow remains
+  if (use_kernel(image)) {
+    kernel_halo(pixman_image_get_data(image),
+                pixman_image_get_stride(image) / sizeof(uint32_t), r, 0,
+                &halo_cut, &halo_glow);
+    return;
+  }
+
+  pixman_image_fill_rectangles(PIXMAN_OP_SRC, image,
+                               &(pixman_color_t){0, 0, 0, 0}, 1,
+                               &(pixman_rectangle16_t){0, 0, 2 * r, 2 * r});
+  draw_circle_with_gradient(image, r, r, r);
+}
+
+static int atlas_radius(int radius_min, int radius_max, int count, int i) {
+  return count > 1 ? radius_min + (radius_max - radius_min) * i / (count - 1)
+                   : radius_min;
+}
+
+static void atlas_free(struct halo_atlas *atlas) {
+  for (int i = 0; i < atlas->count; i++) {
+    if (atlas->frames[i] != NULL)
+      pixman_image_unref(atlas->frames[i]);
+  }
+  free(atlas->bits);
+}
+
+pixman_image_t *render_atlas_frame(int radius_min, int radius_max, int count,
+                                   int index, int scale120) {
+  if (count > RENDER_ATLAS_MAX_FRAMES)
+    count = RENDER_ATLAS_MAX_FRAMES;
+  if (index < 0 || index >= count)
+    return NULL;
+
+  tll_foreach(halo_atlases, it) {
+    const struct halo_atlas *a = &it->item;
+    if (a->radius_min == radius_min && a->radius_max == radius_max &&
+        a->count == count && a->scale120 == scale120)
+      return a->frames[index];
+  }
+
+  // Frames are stacked vertically, each as wide as it needs to be
+  const int width = 2 * scale_to_px(radius_max, scale120);
+  size_t rows = 0;
+  for (int i = 0; i < count; i++)
+    rows += 2 * scale_to_px(atlas_radius(radius_min, radius_max, count, i),
+                            scale120);
+
+  struct halo_atlas atlas = {
+      .radius_min = radius_min,
+      .radius_max = radius_max,
+      .count = count,
+      .scale120 = scale120,
+      .bits = malloc((size_t)width * rows * sizeof(uint32_t)),
+  };
+  if (atlas.bits == NULL) {
+    LOG_ERRNO("failed to allocate %dx%zu halo atlas", width, rows);
+    return NULL;
+  }
+
+  size_t y = 0;
+  for (int i = 0; i < count; i++) {
+    const int r = scale_to_px(atlas_radius(radius_min, radius_max, count, i),
+                              scale120);
+    atlas.frames[i] = pixman_image_create_bits(
+        PIXMAN_x8r8g8b8, 2 * r, 2 * r, atlas.bits + y * width,
+        width * sizeof(uint32_t));
+    if (atlas.frames[i] == NULL) {
+      LOG_ERR("failed to create halo atlas frame %d", i);
+      atlas_free(&atlas);
+      return NULL;
+    }
+
+    halo_rasterize(atlas.frames[i], r);
+    y += 2 * r;
+  }
+
+  LOG_DBG("%d frame halo atlas at scale %.2f: %dx%zu", count, scale120 / 120.,
+          width, rows);
+  tll_push_back(halo_atlases, atlas);
+  return tll_back(halo_atlases).frames[index];
+}
+
+void render_drop_atlases(void) {
+  tll_foreach(halo_atlases, it) {
+    atlas_free(&it->item);
+    tll_remove(halo_atlases, it);
+  }
+}
+
+void render_prune_sprites(bool (*keep)(int scale120)) {
+  tll_foreach(halo_sprites, it) {
+    if (!keep(it->item.scale120)) {
+      pixman_image_unref(it->item.pix);
+      tll_remove(halo_sprites, it);
+    }
+  }
+
+  tll_foreach(halo_atlases, it) {
+    if (!keep(it->item.scale120)) {
+      atlas_free(&it->item);
+      tll_remove(halo_atlases, it);
+    }
+  }
+}
+
+void render_halo(pixman_image_t *image, int cx, int cy, int radius,
+                 int scale120) {
+  pixman_image_t *sprite = render_halo_sprite(radius, scale120);
+  if (sprite == NULL)
+    return;
+
+  const int r = scale_to_px(radius, scale120);
+  pixman_image_composite32(PIXMAN_OP_SRC, sprite, NULL, image, 0, 0, 0, 0,
+                           cx - r, cy - r, 2 * r, 2 * r);
+}
+
+void render_dim(pixman_image_t *image, int x, int y, int width, int height) {
+  if (!use_kernel(image)) {
+    pixman_image_composite32(PIXMAN_OP_SRC, fill, NULL, image, 0, 0, 0, 0, x,
+                             y, width, height);
+    return;
+  }
+
+  // Clip like pixman does
+  const int x1 = x + width < pixman_image_get_width(image)
+                     ? x + width
+                     : pixman_image_get_width(image);
+  const int y1 = y + height < pixman_image_get_height(image)
+                     ? y + height
+                     : pixman_image_get_height(image);
+  x = x < 0 ? 0 : x;
+  y = y < 0 ? 0 : y;
+  if (x >= x1 || y >= y1)
+    return;
+
+  const size_t stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+  kernel_fill(pixman_image_get_data(image) + y * stride + x, stride, x1 - x,
+              y1 - y, dim_pixel,
+              (size_t)(x1 - x) * (y1 - y) >= STREAM_THRESHOLD);
+}
+
+/*
+ * Only reads the sprite's pixels and writes the image's inside the box; no
+ * pixman calls that could validate (and so modify) a shared image.
+ */
+static void rect_kernel(pixman_image_t *image, const pixman_box32_t *box,
+                        pixman_image_t *sprite, int cx, int cy, bool stream) {
+  const size_t stride = pixman_image_get_stride(image) / sizeof(uint32_t);
+  uint32_t *data = pixman_image_get_data(image);
+  const int x1 = box->x1, y1 = box->y1, x2 = box->x2, y2 = box->y2;
+
+  // Part of the box covered by the sprite
+  int sx1 = x1, sy1 = y1, sx2 = x1, sy2 = y1;
+  if (sprite != NULL) {
+    const int r = pixman_image_get_width(sprite) / 2;
+    sx1 = cx - r > x1 ? cx - r : x1;
+    sy1 = cy - r > y1 ? cy - r : y1;
+    sx2 = cx + r < x2 ? cx + r : x2;
+    sy2 = cy + r < y2 ? cy + r : y2;
+  }
+  if (sx1 >= sx2 || sy1 >= sy2) {
+    kernel_fill(data + y1 * stride + x1, stride, x2 - x1, y2 - y1, dim_pixel,
+                stream);
+    return;
+  }
+
+  // Rows above and below the sprite, then both sides of it
+  kernel_fill(data + y1 * stride + x1, stride, x2 - x1, sy1 - y1, dim_pixel,
+              stream);
+  kernel_fill(data + sy2 * stride + x1, stride, x2 - x1, y2 - sy2, dim_pixel,
+              stream);
+  kernel_fill(data + sy1 * stride + x1, stride, sx1 - x1, sy2 - sy1,
+              dim_pixel, stream);
+  kernel_fill(data + sy1 * stride + sx2, stride, x2 - sx2, sy2 - sy1,
+              dim_pixel, stream);
+
+  const int r = pixman_image_get_width(sprite) / 2;
+  const size_t sstride = pixman_image_get_stride(sprite) / sizeof(uint32_t);
+  const uint32_t *src = pixman_image_get_data(sprite) +
+                        (sy1 - (cy - r)) * sstride + (sx1 - (cx - r));
+  for (int y = sy1; y < sy2; y++, src += sstride)
+    memcpy(data + y * stride + sx1, src, (sx2 - sx1) * sizeof(uint32_t));
+}
+
+bool render_rect_threaded(pixman_image_t *image, pixman_image_t *sprite) {
+  return use_kernel(image) &&
+         (sprite == NULL ||
+          pixman_image_get_format(sprite) == pixman_image_get_format(image));
+}
+
+void render_rect(pixman_image_t *image, const pixman_box32_t *box,
+                 pixman_image_t *sprite, int cx, int cy, bool stream) {
+  // Clip like pixman does
+  const int width = pixman_image_get_width(image);
+  const int height = pixman_image_get_height(image);
+  const pixman_box32_t b = {
+      .x1 = box->x1 < 0 ? 0 : box->x1,
+      .y1 = box->y1 < 0 ? 0 : box->y1,
+      .x2 = box->x2 > width ? width : box->x2,
+      .y2 = box->y2 > height ? height : box->y2,
+  };
+  if (b.x1 >= b.x2 || b.y1 >= b.y2)
+    return;
+
+  if (render_rect_threaded(image, sprite)) {
+    rect_kernel(image, &b, sprite, cx, cy, stream);
+    return;
+  }
+
+  render_dim(image, b.x1, b.y1, b.x2 - b.x1, b.y2 - b.y1);
+  if (sprite != NULL) {
+    const int r = pixman_image_get_width(sprite) / 2;
+    pixman_box32_t s;
+    if (render_halo_box(&s, cx, cy, r, width, height) && s.x1 < b.x2 &&
+        b.x1 < s.x2 && s.y1 < b.y2 && b.y1 < s.y2) {
+      const int x1 = s.x1 > b.x1 ? s.x1 : b.x1;
+      const int y1 = s.y1 > b.y1 ? s.y1 : b.y1;
+      const int x2 = s.x2 < b.x2 ? s.x2 : b.x2;
+      const int y2 = s.y2 < b.y2 ? s.y2 : b.y2;
+      pixman_image_composite32(PIXMAN_OP_SRC, sprite, NULL, image,
+                               x1 - (cx - r), y1 - (cy - r), 0, 0, x1, y1,
+                               x2 - x1, y2 - y1);
+    }
+  }
+}
+
+void render_use_pixman(bool pixman) { use_pixman = pixman; }
+
+// Alpha of the lens disc, cached for the last radius asked for
+static pixman_image_t *lens_mask;
+static int lens_radius;
+
+static pixman_image_t *lens_mask_get(int radius) {
+  if (lens_mask != NULL && lens_radius == radius)
+    return lens_mask;
+
+  if (lens_mask != NULL)
+    pixman_image_unref(lens_mask);
+
+  const int size = 2 * radius;
+  lens_mask = pixman_image_create_bits(PIXMAN_a8, size, size, NULL, 0);
+  if (lens_mask == NULL) {
+    LOG_ERR("failed to allocate %dx%d lens mask", size, size);
+    return NULL;
+  }
+  lens_radius = radius;
+
+  // Opaque inside, with a pixel wide edge
+  uint8_t *data = (uint8_t *)pixman_image_get_data(lens_mask);
+  const int stride = pixman_image_get_stride(lens_mask);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      const double a = radius - hypot(x + .5 - radius, y + .5 - radius) + .5;
+      data[y * stride + x] = a <= 0 ? 0 : a >= 1 ? 255 : (uint8_t)(a * 255);
+    }
+  }
+  return lens_mask;
+}
+
+void render_lens(pixman_image_t *image, pixman_image_t *capture, bool y_invert,
+                 int cx, int cy, int radius) {
+  pixman_image_t *mask = lens_mask_get(radius);
+  if (mask == NULL)
+    return;
+
+  // Lens pixels to capture pixels: the capture spans the whole lens box
+  const int width = pixman_image_get_width(capture);
+  const int height = pixman_image_get_height(capture);
+  pixman_transform_t t;
+  pixman_transform_init_scale(&t, pixman_double_to_fixed(width / (2. * radius)),
+                              pixman_double_to_fixed(height / (2. * radius)));
+  if (y_invert) {
+    t.matrix[1][1] = -t.matrix[1][1];
+    t.matrix[1][2] = pixman_int_to_fixed(height);
+  }
+
+  pixman_image_set_transform(capture, &t);
+  pixman_image_set_filter(capture, PIXMAN_FILTER_BILINEAR, NULL, 0);
+  pixman_image_composite32(PIXMAN_OP_OVER, capture, mask, image, 0, 0, 0, 0,
+                           cx - radius, cy - radius, 2 * radius, 2 * radius);
+  pixman_image_set_transform(capture, NULL);
+}
+
+bool render_halo_box(pixman_box32_t *box, int cx, int cy, int radius,
+                     int width, int height) {
+  box->x1 = cx - radius < 0 ? 0 : cx - radius;
+  box->y1 = cy - radius < 0 ? 0 : cy - radius;
+  box->x2 = cx + radius > width ? width : cx + radius;
+  box->y2 = cy + radius > height ? height : cy + radius;
+  return box->x1 < box->x2 && box->y1 < box->y2;
+}
+
+bool render_init(const pixman_color_t *dim) {
+  kernel_init();
+  kernel_gradient_from_pixman(&halo_cut, halo_cut_stops, 3);
+  kernel_gradient_from_pixman(&halo_glow, halo_glow_stops, 4);
+
+  // What pixman stores for a solid fill of a 32-bit ARGB image
+  dim_pixel = (uint32_t)(dim->alpha >> 8) << 24 | (uint32_t)(dim->red >> 8) << 16 |
+              (uint32_t)(dim->green >> 8) << 8 | (uint32_t)(dim->blue >> 8);
+
+  fill = pixman_image_create_solid_fill(dim);
+  return fill != NULL;
+}
+
+void render_fini(void) {
+  tll_foreach(halo_sprites, it) pixman_image_unref(it->item.pix);
+  tll_free(halo_sprites);
+  render_drop_atlases();
+
+  if (lens_mask != NULL)
+    pixman_image_unref(lens_mask);
+  lens_mask = NULL;
+
+  if (fill != NULL)
+    pixman_image_unref(fill);
+  fill = NULL;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include <pixman.h>
+
+/*
+ * Software rendering of the dim layer and the halo into plain pixman
+ * images. Nothing in here knows about Wayland, so the benchmark can drive
+ * the exact same code as mhalo.
+ */
+
+/* Logical size to buffer pixels; scales are in 120ths, like wp_fractional_scale_v1 */
+static inline int scale_to_px(int v, int scale120) { return (v * scale120 + 60) / 120; }
+
+bool render_init(const pixman_color_t *dim);
+void render_fini(void);
+
+/* Fill a rectangle of 'image' with the dim color */
+void render_dim(pixman_image_t *image, int x, int y, int width, int height);
+
+/*
+ * Render with pixman instead of the SIMD kernels; the reference the
+ * kernels are checked against
+ */
+void render_use_pixman(bool pixman);
+
+/*
+ * The halo over the dim color, 2r x 2r pixels. Rasterized on first use
+ * and cached per radius and scale.
+ */
+pixman_image_t *render_halo_sprite(int radius, int scale120);
+
+/*
+ * Only the halo's glow, over transparency, into the top left 2r x 2r pixels
+ * of an image with alpha. For drawing on top of the dim layer instead of
+ * into it.
+ */
+void render_halo_glow(pixman_image_t *image, int radius, int scale120);
+
+#define RENDER_ATLAS_MAX_FRAMES 32
+
+/*
+ * Frame 'index' of an atlas of 'count' halos with radii evenly spaced from
+ * 'radius_min' (frame 0) to 'radius_max'. The whole atlas is rasterized on
+ * first use and cached per scale; frames are 2r x 2r like the sprite.
+ */
+pixman_image_t *render_atlas_frame(int radius_min, int radius_max, int count,
+                                   int index, int scale120);
+
+/* Free all atlases, e.g. once an animation has finished */
+void render_drop_atlases(void);
+
+/* Blit the halo sprite centered at (cx, cy), in buffer pixels */
+void render_halo(pixman_image_t *image, int cx, int cy, int radius, int scale120);
+
+/* Drop the cached sprites and atlases of scales for which 'keep' returns false */
+void render_prune_sprites(bool (*keep)(int scale120));
+
+/*
+ * Repaint 'box' of a frame whose halo 'sprite' (or NULL) is centered at
+ * (cx, cy): the sprite where it overlaps the box, the dim color elsewhere.
+ * 'stream' bypasses the cache, for boxes that are part of a full repaint.
+ */
+void render_rect(pixman_image_t *image, const pixman_box32_t *box,
+                 pixman_image_t *sprite, int cx, int cy, bool stream);
+
+/*
+ * Whether render_rect() may paint disjoint boxes of one frame from several
+ * threads at once. Only the kernels are thread-safe: they touch nothing
+ * outside the box and no shared state. The pixman fallback, taken with
+ * render_use_pixman() or formats the kernels don't handle, composites the
+ * shared dim and sprite images, so it must stay on one thread.
+ */
+bool render_rect_threaded(pixman_image_t *image, pixman_image_t *sprite);
+
+/*
+ * A zoom lens centered at (cx, cy): 'capture' scaled to fill a disc of
+ * radius r, in buffer pixels. 'y_invert' flips the capture.
+ */
+void render_lens(pixman_image_t *image, pixman_image_t *capture, bool y_invert,
+                 int cx, int cy, int radius);
+
+/* Box of a halo centered at (cx, cy), clipped to width x height */
+bool render_halo_box(pixman_box32_t *box, int cx, int cy, int radius,
+                     int width, int height);
@@ -0,0 +1,57 @@
+#include "scheduler.h"
+
+#define LOG_MODULE "sched"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+// Plausible refresh periods: 10 Hz to 500 Hz
+#define MIN_REFRESH_NS 2000000ull
+#define MAX_REFRESH_NS 100000000ull
+
+void sched_presented(struct sched *s, uint64_t present_ns, uint32_t refresh_ns) {
+  if (refresh_ns > 0) {
+    s->refresh_ns = refresh_ns;
+  } else if (s->last_present_ns > 0 && present_ns > s->last_present_ns) {
+    /*
+     * Variable refresh rate, or a compositor that does not know: estimate
+     * from back-to-back presentations. Gaps of several periods are idle
+     * time, so only shorter ones pull the estimate.
+     */
+    const uint64_t delta = present_ns - s->last_present_ns;
+    if (delta >= MIN_REFRESH_NS && delta <= MAX_REFRESH_NS &&
+        (s->refresh_ns == 0 || delta < s->refresh_ns * 3 / 2)) {
+      s->refresh_ns =
+          s->refresh_ns == 0 ? delta : (s->refresh_ns * 7 + delta) / 8;
+    }
+  }
+
+  if (present_ns > s->last_present_ns)
+    s->last_present_ns = present_ns;
+}
+
+void sched_painted(struct sched *s, uint64_t paint_ns) {
+  // Rise quickly, decay slowly: a late frame costs a whole refresh
+  if (paint_ns > s->paint_ns)
+    s->paint_ns = (s->paint_ns + paint_ns) / 2;
+  else
+    s->paint_ns = (s->paint_ns * 15 + paint_ns) / 16;
+}
+
+uint64_t sched_deadline(const struct sched *s, uint64_t now_ns,
+                        uint64_t slack_ns) {
+  if (s->refresh_ns == 0 || s->last_present_ns == 0)
+    return 0;
+
+  // First refresh after now, extrapolated from the latest presentation
+  uint64_t next = s->last_present_ns + s->refresh_ns;
+  if (now_ns >= next)
+    next += (now_ns - next) / s->refresh_ns * s->refresh_ns + s->refresh_ns;
+
+  const uint64_t lead = s->paint_ns + slack_ns;
+  while (next < now_ns + lead)
+    next += s->refresh_ns;
+
+  LOG_DBG("next refresh in %.2f ms, painting %.2f ms before it",
+          (next - now_ns) / 1e6, lead / 1e6);
+  return next - lead;
+}
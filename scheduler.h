@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Refresh timing of one output, learned from wp_presentation feedback, to
+ * start painting just in time for the next refresh. All times are in
+ * nanoseconds on the presentation clock.
+ */
+
+struct sched {
+  uint64_t refresh_ns;      // refresh period, 0 until known
+  uint64_t last_present_ns; // latest presentation
+  uint64_t paint_ns;        // average time from painting to commit
+};
+
+void sched_presented(struct sched *s, uint64_t present_ns, uint32_t refresh_ns);
+void sched_painted(struct sched *s, uint64_t paint_ns);
+
+/*
+ * When to start painting a frame so it is committed 'slack_ns' before the
+ * first refresh it can still make after 'now_ns'. 0 if the timing is not
+ * known yet.
+ */
+uint64_t sched_deadline(const struct sched *s, uint64_t now_ns,
+                        uint64_t slack_ns);
@@ -3,140 +3,315 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <linux/memfd.h>
-#include <sys/mman.h>
 #include <sys/types.h>
 
 #include <tllist.h>
 
 #define LOG_MODULE "shm"
 #include "log.h"
+#include "memfd.h"
+#include "stats.h"
 #include "stride.h"
+#include "trace.h"
+
+/*
+ * A memfd-backed wl_shm_pool. Buffers are carved out of it at offsets, and
+ * the pool grows with wl_shm_pool_resize() when they no longer fit. This
+ * keeps the number of fds, mappings and syscalls down when outputs are
+ * resized or change scale. Each swapchain has its own pool; caller-owned
+ * buffers share another one. A pool is torn down with its last buffer.
+ */
+struct shm_pool {
+  struct shm_pool **owner; // cleared when the pool is destroyed
+  struct memfd_map map;
+  struct wl_shm_pool *wl_pool;
+
+  tll(struct buffer *) buffers;
+};
 
-#if !defined(MAP_UNINITIALIZED)
-#define MAP_UNINITIALIZED 0
-#endif
+// Pool for shm_create_buffer()
+static struct shm_pool *owned_pool;
 
-#if !defined(MFD_NOEXEC_SEAL)
-#define MFD_NOEXEC_SEAL 0
-#endif
+// Bytes of all pools, checked against the limit before growing
+static size_t memory_used;
+static size_t memory_limit;
 
-#define BUFFER_TIMEOUT_SEC 3
+static struct stats_shm stats;
 
-static tll(struct buffer *) buffer_queue = tll_init();
+void shm_set_memory_limit(size_t bytes) { memory_limit = bytes; }
 
-static void buffer_destroy(struct buffer *buf) {
-  pixman_image_unref(buf->pix);
-  wl_buffer_destroy(buf->wl_buf);
-  munmap(buf->mmapped, buf->size);
-  free(buf);
+static bool memory_reserve(size_t bytes) {
+  if (memory_limit > 0 && memory_used + bytes > memory_limit) {
+    LOG_WARN("SHM memory limit reached (%zu + %zu > %zu bytes)", memory_used,
+             bytes, memory_limit);
+    return false;
+  }
+
+  memory_used += bytes;
+  return true;
 }
 
-static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
-  struct buffer *buffer = data;
+static void pool_destroy(struct shm_pool *pool) {
+  assert(tll_length(pool->buffers) == 0);
 
-  // Mark buffer as not busy and update last used time
-  buffer->busy = false;
-  buffer->last_used = time(NULL);
+  if (pool->owner != NULL)
+    *pool->owner = NULL;
 
-  // Move the buffer to the reusable queue
-  tll_push_back(buffer_queue, buffer);
+  wl_shm_pool_destroy(pool->wl_pool);
+  memory_used -= pool->map.size;
+  memfd_map_destroy(&pool->map);
+  free(pool);
 }
 
-static const struct wl_buffer_listener buffer_listener = {
-    .release = &buffer_release,
-};
+/*
+ * Huge pages, when the system has any reserved, and prefaulting keep the
+ * first full-frame paint of a new buffer from taking a page fault for
+ * every 4 KiB of it. Small pools would waste most of a huge page.
+ */
+#define HUGETLB_MIN_SIZE (2 * 1024 * 1024)
+
+static struct shm_pool *pool_create(struct wl_shm *shm, size_t size,
+                                    struct shm_pool **owner) {
+  struct memfd_map map;
+  struct wl_shm_pool *wl_pool = NULL;
+
+  if (!memory_reserve(size))
+    return NULL;
+
+  const unsigned flags =
+      MEMFD_PREFAULT | (size >= HUGETLB_MIN_SIZE ? MEMFD_HUGETLB : 0);
+  if (!memfd_map_create(&map, "mhalo-wayland-shm-buffer-pool", size, flags)) {
+    memory_used -= size;
+    return NULL;
+  }
 
-static void cleanup_old_buffers() {
-  time_t now = time(NULL);
+  // Rounded up to whole pages
+  memory_used += map.size - size;
+  if (memory_used > stats.bytes_peak)
+    stats.bytes_peak = memory_used;
 
-  tll_foreach(buffer_queue, it) {
-    if (!it->item->busy &&
-        difftime(now, it->item->last_used) >= BUFFER_TIMEOUT_SEC) {
-      buffer_destroy(it->item);
-      tll_remove(buffer_queue, it);
-    }
+  if (map.size > INT32_MAX) {
+    LOG_ERR("SHM pool would exceed %d bytes", INT32_MAX);
+    goto err;
   }
+
+  wl_pool = wl_shm_create_pool(shm, map.fd, map.size);
+  if (wl_pool == NULL) {
+    LOG_ERR("failed to create SHM pool");
+    goto err;
+  }
+
+  struct shm_pool *pool = malloc(sizeof(*pool));
+  *pool = (struct shm_pool){
+      .owner = owner,
+      .map = map,
+      .wl_pool = wl_pool,
+      .buffers = tll_init(),
+  };
+  *owner = pool;
+  return pool;
+
+err:
+  memory_used -= map.size;
+  memfd_map_destroy(&map);
+  return NULL;
 }
 
-struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height,
-                              unsigned long cookie) {
-  cleanup_old_buffers();
+static bool pool_grow(struct shm_pool *pool, size_t size) {
+  const size_t old_size = pool->map.size;
 
-  // Try to reuse a buffer from the queue
-  tll_foreach(buffer_queue, it) {
-    struct buffer *buffer = it->item;
-    if (!buffer->busy && buffer->width == width && buffer->height == height &&
-        buffer->cookie == cookie) {
-      tll_remove(buffer_queue, it);
-      buffer->busy = true;
-      buffer->cookie = cookie;
-      return buffer;
-    }
+  if (size > INT32_MAX) {
+    LOG_ERR("SHM pool would exceed %d bytes", INT32_MAX);
+    return false;
   }
 
-  // If no reusable buffer is found, create a new one
-  int pool_fd = -1;
-  void *mmapped = NULL;
-  size_t size = 0;
+  if (!memory_reserve(size - old_size))
+    return false;
 
-  struct wl_shm_pool *pool = NULL;
-  struct wl_buffer *buf = NULL;
-  pixman_image_t *pix = NULL;
+  if (!memfd_map_grow(&pool->map, size)) {
+    memory_used -= size - old_size;
+    return false;
+  }
 
-  errno = 0;
-  pool_fd = memfd_create("mhalo-wayland-shm-buffer-pool",
-                         MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_NOEXEC_SEAL);
+  // Rounded up to whole pages
+  memory_used += pool->map.size - size;
+  if (memory_used > stats.bytes_peak)
+    stats.bytes_peak = memory_used;
 
-  if (pool_fd < 0 && errno == EINVAL) {
-    pool_fd = memfd_create("mhalo-wayland-shm-buffer-pool",
-                           MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (pool->map.size > INT32_MAX) {
+    LOG_ERR("SHM pool would exceed %d bytes", INT32_MAX);
+    return false;
   }
 
-  if (pool_fd == -1) {
-    LOG_ERRNO("failed to create SHM backing memory file");
-    goto err;
+  wl_shm_pool_resize(pool->wl_pool, pool->map.size);
+
+  // The mapping may have moved; re-point the live buffers
+  tll_foreach(pool->buffers, it) {
+    struct buffer *buf = it->item;
+    void *mmapped = (uint8_t *)pool->map.mem + buf->offset;
+    pixman_image_t *pix = pixman_image_create_bits_no_clear(
+        PIXMAN_x8r8g8b8, buf->width, buf->height, mmapped, buf->stride);
+    if (pix == NULL) {
+      LOG_ERR("failed to create pixman image");
+      continue;
+    }
+
+    pixman_image_unref(buf->pix);
+    buf->pix = pix;
+    buf->mmapped = mmapped;
   }
 
-  const uint32_t stride = stride_for_format_and_width(PIXMAN_a8r8g8b8, width);
-  size = stride * height;
-  if (ftruncate(pool_fd, size) == -1) {
-    LOG_ERRNO("failed to truncate SHM pool");
-    goto err;
+  return true;
+}
+
+// First fit among the gaps between live buffers; SIZE_MAX if none fits
+static size_t pool_find_space(const struct shm_pool *pool, size_t size) {
+  size_t candidate = 0;
+  bool moved;
+
+  do {
+    moved = false;
+    tll_foreach(pool->buffers, it) {
+      const struct buffer *buf = it->item;
+      if (candidate < buf->offset + buf->size &&
+          buf->offset < candidate + size) {
+        candidate = buf->offset + buf->size;
+        moved = true;
+      }
+    }
+  } while (moved);
+
+  return candidate + size <= pool->map.size ? candidate : SIZE_MAX;
+}
+
+static size_t pool_used_end(const struct shm_pool *pool) {
+  size_t end = 0;
+  tll_foreach(pool->buffers, it) {
+    if (it->item->offset + it->item->size > end)
+      end = it->item->offset + it->item->size;
   }
+  return end;
+}
 
-  mmapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, 0);
-  if (mmapped == MAP_FAILED) {
-    LOG_ERR("failed to mmap SHM backing memory file");
-    goto err;
+/*
+ * Hand the pages of a freed range back right away; it is reused on demand.
+ * Only whole pages go, huge ones on hugetlbfs, since the pages at either end
+ * may hold a neighbor's pixels.
+ */
+static void pool_punch_hole(struct shm_pool *pool, size_t offset,
+                            size_t size) {
+  const size_t page = pool->map.page_size;
+  const size_t start = (offset + page - 1) / page * page;
+  const size_t end = (offset + size) / page * page;
+  if (start >= end)
+    return;
+
+  if (fallocate(pool->map.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                start, end - start) < 0) {
+    LOG_ERRNO("failed to release %zu bytes of SHM backing memory",
+              end - start);
+  }
+}
+
+static void buffer_destroy(struct buffer *buf) {
+  struct shm_pool *pool = buf->pool;
+
+  if (buf->chain != NULL)
+    buf->chain->slots[buf->slot] = NULL;
+
+  pixman_image_unref(buf->pix);
+  wl_buffer_destroy(buf->wl_buf);
+
+  tll_foreach(pool->buffers, it) {
+    if (it->item == buf) {
+      tll_remove(pool->buffers, it);
+      break;
+    }
   }
 
-  if (fcntl(pool_fd, F_ADD_SEALS,
-            F_SEAL_GROW | F_SEAL_SHRINK |
-                /*F_SEAL_FUTURE_WRITE |*/ F_SEAL_SEAL) < 0) {
-    LOG_ERRNO("failed to seal SHM backing memory file");
+  if (tll_length(pool->buffers) == 0) {
+    pool_destroy(pool);
+  } else {
+    pool_punch_hole(pool, buf->offset, buf->size);
   }
+  free(buf);
+  stats.buffers_destroyed++;
+}
+
+static bool buffer_is_stale(const struct buffer *buf) {
+  const struct shm_swapchain *chain = buf->chain;
+  return buf->width != chain->width || buf->height != chain->height;
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+  struct buffer *buffer = data;
+  struct shm_swapchain *chain = buffer->chain;
+  buffer->busy = false;
+
+  const bool stale = chain != NULL && buffer_is_stale(buffer);
+  TRACE(TRACE_BUFFER_RELEASE, buffer->chain != NULL ? buffer->slot : -1,
+        stale);
+
+  // Buffers from an old output geometry are of no further use
+  if (stale || buffer->purge)
+    buffer_destroy(buffer);
+
+  if (chain != NULL && chain->released != NULL)
+    chain->released(chain->data);
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = &buffer_release,
+};
+
+static struct buffer *buffer_create(struct wl_shm *shm, int width, int height,
+                                    uint32_t format,
+                                    struct shm_pool **pool_ptr) {
+  const uint32_t stride = stride_for_format_and_width(PIXMAN_a8r8g8b8, width);
+  const size_t size = (size_t)stride * height;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  struct shm_pool *pool = *pool_ptr;
+  size_t offset = SIZE_MAX;
+  const bool populated = pool == NULL; // mapped with MEMFD_PREFAULT
 
-  pool = wl_shm_create_pool(shm, pool_fd, size);
   if (pool == NULL) {
-    LOG_ERR("failed to create SHM pool");
-    goto err;
+    pool = pool_create(shm, size, pool_ptr);
+    if (pool == NULL)
+      return NULL;
+    offset = 0;
+  } else {
+    offset = pool_find_space(pool, size);
+    if (offset == SIZE_MAX) {
+      // Append behind the last live buffer
+      offset = pool_used_end(pool);
+      if (!pool_grow(pool, offset + size))
+        return NULL;
+    }
   }
 
-  buf = wl_shm_pool_create_buffer(pool, 0, width, height, stride,
-                                  WL_SHM_FORMAT_ARGB8888);
+  struct wl_buffer *buf = NULL;
+  pixman_image_t *pix = NULL;
+
+  buf = wl_shm_pool_create_buffer(pool->wl_pool, offset, width, height, stride,
+                                  format);
   if (buf == NULL) {
     LOG_ERR("failed to create SHM buffer");
     goto err;
   }
 
-  wl_shm_pool_destroy(pool);
-  pool = NULL;
-  close(pool_fd);
-  pool_fd = -1;
+  void *mmapped = (uint8_t *)pool->map.mem + offset;
 
+  // A new pool is populated already; reused or grown ranges are not
+  if (!populated)
+    memfd_prefault(&pool->map, mmapped, size);
   pix = pixman_image_create_bits_no_clear(PIXMAN_x8r8g8b8, width, height,
                                           mmapped, stride);
   if (pix == NULL) {
@@ -149,16 +324,23 @@ struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height,
       .width = width,
       .height = height,
       .stride = stride,
-      .cookie = cookie,
       .busy = true,
       .size = size,
+      .offset = offset,
       .mmapped = mmapped,
+      .pool = pool,
       .wl_buf = buf,
       .pix = pix,
-      .last_used = time(NULL), // Initialize with current time
   };
 
+  tll_push_back(pool->buffers, buffer);
   wl_buffer_add_listener(buffer->wl_buf, &buffer_listener, buffer);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  stats_hist_add(&stats.alloc_ns, (now.tv_sec - start.tv_sec) * 1000000000ull +
+                                      now.tv_nsec - start.tv_nsec);
+  stats.buffers_created++;
   return buffer;
 
 err:
@@ -166,12 +348,118 @@ err:
     pixman_image_unref(pix);
   if (buf != NULL)
     wl_buffer_destroy(buf);
-  if (pool != NULL)
-    wl_shm_pool_destroy(pool);
-  if (pool_fd != -1)
-    close(pool_fd);
-  if (mmapped != NULL)
-    munmap(mmapped, size);
+  if (tll_length(pool->buffers) == 0)
+    pool_destroy(pool);
 
   return NULL;
 }
+
+struct shm_swapchain *shm_swapchain_create(struct wl_shm *shm,
+                                           void (*released)(void *data),
+                                           void *data) {
+  struct shm_swapchain *chain = malloc(sizeof(*chain));
+  *chain = (struct shm_swapchain){
+      .shm = shm, .released = released, .data = data};
+  return chain;
+}
+
+void shm_swapchain_destroy(struct shm_swapchain *chain) {
+  if (chain == NULL)
+    return;
+
+  for (size_t i = 0; i < SHM_SWAPCHAIN_LEN; i++) {
+    if (chain->slots[i] != NULL)
+      buffer_destroy(chain->slots[i]);
+  }
+
+  assert(chain->pool == NULL);
+  free(chain);
+}
+
+struct buffer *shm_swapchain_acquire(struct shm_swapchain *chain, int width,
+                                     int height) {
+  if (chain->width != width || chain->height != height) {
+    chain->width = width;
+    chain->height = height;
+
+    // Free what the compositor isn't holding; the rest goes on release
+    for (size_t i = 0; i < SHM_SWAPCHAIN_LEN; i++) {
+      struct buffer *buf = chain->slots[i];
+      if (buf != NULL && !buf->busy)
+        buffer_destroy(buf);
+    }
+  }
+
+  ssize_t empty = -1;
+  for (size_t i = 0; i < SHM_SWAPCHAIN_LEN; i++) {
+    struct buffer *buf = chain->slots[i];
+    if (buf == NULL) {
+      if (empty < 0)
+        empty = i;
+    } else if (!buf->busy && !buffer_is_stale(buf)) {
+      buf->busy = true;
+      TRACE(TRACE_BUFFER_ACQUIRE, i, false);
+      return buf;
+    }
+  }
+
+  if (empty < 0) {
+    LOG_DBG("all %d buffers are busy", SHM_SWAPCHAIN_LEN);
+    TRACE(TRACE_BUFFER_ACQUIRE, -1, false);
+    return NULL;
+  }
+
+  struct buffer *buf = buffer_create(chain->shm, width, height,
+                                     WL_SHM_FORMAT_ARGB8888, &chain->pool);
+  if (buf == NULL)
+    return NULL;
+
+  buf->chain = chain;
+  buf->slot = empty;
+  chain->slots[empty] = buf;
+  TRACE(TRACE_BUFFER_ACQUIRE, empty, true);
+  return buf;
+}
+
+void shm_swapchain_put_back(struct buffer *buf) {
+  buf->busy = false;
+}
+
+struct buffer *shm_create_buffer_format(struct wl_shm *shm, int width,
+                                        int height, uint32_t format) {
+  if (format != WL_SHM_FORMAT_ARGB8888 && format != WL_SHM_FORMAT_XRGB8888) {
+    LOG_ERR("unsupported SHM format 0x%08x", format);
+    return NULL;
+  }
+
+  struct buffer *buffer =
+      buffer_create(shm, width, height, format, &owned_pool);
+  if (buffer != NULL)
+    buffer->busy = false; // until the caller attaches it
+  return buffer;
+}
+
+struct buffer *shm_create_buffer(struct wl_shm *shm, int width, int height) {
+  return shm_create_buffer_format(shm, width, height, WL_SHM_FORMAT_ARGB8888);
+}
+
+void shm_destroy_buffer(struct buffer *buf) {
+  if (buf == NULL)
+    return;
+
+  assert(buf->chain == NULL);
+  buffer_destroy(buf);
+}
+
+void shm_destroy_buffer_on_release(struct buffer *buf) {
+  if (buf == NULL)
+    return;
+
+  assert(buf->chain == NULL);
+  if (buf->busy)
+    buf->purge = true;
+  else
+    buffer_destroy(buf);
+}
+
+void shm_log_stats(void) { stats_shm_log(&stats, memory_used); }
@@ -2,26 +2,92 @@
 
 #include <stdbool.h>
 #include <stddef.h>
-#include <time.h>
 
 #include <pixman.h>
 #include <wayland-client.h>
 
+#define SHM_SWAPCHAIN_LEN 3
+
 struct buffer {
     int width;
     int height;
     int stride;
-    unsigned long cookie;
 
     bool busy;
-    bool purge;
+    bool purge;      // free once the compositor releases it
     size_t size;
+    size_t offset;   // into the pool's mapping
     void *mmapped;
+    struct shm_pool *pool;
+
+    // Owning swapchain, NULL for buffers from shm_create_buffer()
+    struct shm_swapchain *chain;
+    size_t slot;
 
     struct wl_buffer *wl_buf;
     pixman_image_t *pix;
-    
-    time_t last_used;  // Timestamp for last use
+
+    /*
+     * What the renderer last painted into this buffer. 'frame' is the
+     * owner's frame counter at that time, or 0 if the contents are undefined
+     * (i.e. a buffer age of 0).
+     */
+    unsigned long frame;
+    bool has_halo;
+    pixman_box32_t halo;
+};
+
+/*
+ * A fixed set of buffers for one surface. Acquiring and releasing are
+ * constant time, and buffers of an old size are freed as soon as the
+ * compositor releases them.
+ */
+struct shm_swapchain {
+    struct wl_shm *shm;
+    struct shm_pool *pool;
+    int width;
+    int height;
+    struct buffer *slots[SHM_SWAPCHAIN_LEN];
+
+    // Called whenever the compositor releases one of the buffers
+    void (*released)(void *data);
+    void *data;
 };
 
-struct buffer *shm_get_buffer(struct wl_shm *shm, int width, int height, unsigned long cookie);
+struct shm_swapchain *shm_swapchain_create(struct wl_shm *shm,
+                                           void (*released)(void *data),
+                                           void *data);
+void shm_swapchain_destroy(struct shm_swapchain *chain);
+
+/* Returns NULL if all buffers are busy or the memory limit is reached */
+struct buffer *shm_swapchain_acquire(struct shm_swapchain *chain, int width, int height);
+
+/* Hand back a buffer that was acquired but never attached; it keeps its pixels */
+void shm_swapchain_put_back(struct buffer *buf);
+
+/*
+ * Buffers that stay attached for a long time (static content). The caller
+ * owns them and frees them with shm_destroy_buffer().
+ */
+struct buffer *shm_create_buffer(struct wl_shm *shm, int width, int height);
+
+/*
+ * Same, in another wl_shm format with the same pixel layout, i.e.
+ * WL_SHM_FORMAT_XRGB8888; for buffers the compositor writes into
+ */
+struct buffer *shm_create_buffer_format(struct wl_shm *shm, int width,
+                                        int height, uint32_t format);
+void shm_destroy_buffer(struct buffer *buf);
+
+/*
+ * Owned buffers are only 'busy' while the caller says so: set it when
+ * attaching one. This frees the buffer once the compositor releases it, or
+ * right away when it is not busy.
+ */
+void shm_destroy_buffer_on_release(struct buffer *buf);
+
+/* Cap on the total size of all SHM pools; 0 means no limit */
+void shm_set_memory_limit(size_t bytes);
+
+/* Log buffer counts, memory use and allocation times (--stats) */
+void shm_log_stats(void);
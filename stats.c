@@ -0,0 +1,85 @@
+#include "stats.h"
+
+#define LOG_MODULE "stats"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+/*
+ * Values below 8 have a bucket each. Above, each power of two [2^n, 2^n+1)
+ * is split into 8 buckets by the 3 bits below the leading one.
+ */
+static size_t bucket_index(uint64_t value) {
+  if (value < 8)
+    return value;
+
+  const int msb = 63 - __builtin_clzll(value);
+  return (msb - 2) * 8 + ((value >> (msb - 3)) & 7);
+}
+
+static uint64_t bucket_start(size_t index) {
+  if (index < 8)
+    return index;
+
+  return (uint64_t)(8 + (index & 7)) << ((index >> 3) - 1);
+}
+
+void stats_hist_add(struct stats_hist *hist, uint64_t value) {
+  hist->buckets[bucket_index(value)]++;
+  hist->count++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+uint64_t stats_hist_percentile(const struct stats_hist *hist, double percent) {
+  if (hist->count == 0)
+    return 0;
+
+  const double rank = hist->count * percent / 100.;
+  unsigned long seen = 0;
+
+  for (size_t i = 0; i < STATS_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen < rank || hist->buckets[i] == 0)
+      continue;
+
+    // The middle of the bucket, but never above the largest sample
+    const uint64_t start = bucket_start(i);
+    const uint64_t end =
+        i + 1 < STATS_HIST_BUCKETS ? bucket_start(i + 1) : hist->max + 1;
+    const uint64_t mid = start + (end - start) / 2;
+    return mid < hist->max ? mid : hist->max;
+  }
+  return hist->max;
+}
+
+static void hist_log(const struct stats_hist *hist, const char *name,
+                     const char *what) {
+  if (hist->count == 0)
+    return;
+
+  LOG_INFO("%s: %s: %lu samples, p50 %.2f ms, p99 %.2f ms, max %.2f ms", name,
+           what, hist->count, stats_hist_percentile(hist, 50) / 1e6,
+           stats_hist_percentile(hist, 99) / 1e6, hist->max / 1e6);
+}
+
+void stats_output_log(const struct stats_output *stats, const char *name) {
+  LOG_INFO("%s: %lu frames painted, %lu redraws deferred while busy, "
+           "%lu skipped without halo",
+           name, stats->frames, stats->skipped_busy, stats->skipped_idle);
+
+  if (stats->frames > 0) {
+    LOG_INFO("%s: %.1f Mpixels composited, %.0f per frame", name,
+             stats->pixels / 1e6, (double)stats->pixels / stats->frames);
+  }
+
+  hist_log(&stats->paint_ns, name, "paint time");
+}
+
+void stats_shm_log(const struct stats_shm *stats, size_t bytes_now) {
+  LOG_INFO("shm: %lu buffers created, %lu destroyed, %.1f MiB in use, "
+           "%.1f MiB peak",
+           stats->buffers_created, stats->buffers_destroyed,
+           bytes_now / 1048576., stats->bytes_peak / 1048576.);
+
+  hist_log(&stats->alloc_ns, "shm", "buffer allocation");
+}
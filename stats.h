@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters for --stats: what each output painted and skipped, and what the
+ * SHM buffers cost. Times go into log-linear histograms with 8 buckets per
+ * power of two, so percentiles are within about 6%.
+ */
+
+#define STATS_HIST_BUCKETS 496
+
+struct stats_hist {
+  unsigned long count;
+  uint64_t max;
+  unsigned long buckets[STATS_HIST_BUCKETS];
+};
+
+void stats_hist_add(struct stats_hist *hist, uint64_t value);
+
+/* Value below which 'percent' of the samples fall; 0 without samples */
+uint64_t stats_hist_percentile(const struct stats_hist *hist, double percent);
+
+struct stats_output {
+  unsigned long frames;       // painted
+  unsigned long skipped_busy; // redraws deferred while a frame was in flight
+  unsigned long skipped_idle; // redraws of an output already without halo
+  uint64_t pixels;            // written by the renderer
+  struct stats_hist paint_ns; // own prepare and commit, share of the jobs
+};
+
+struct stats_shm {
+  unsigned long buffers_created;
+  unsigned long buffers_destroyed;
+  size_t bytes_peak;          // all pools
+  struct stats_hist alloc_ns; // creating a buffer, prefaulting included
+};
+
+void stats_output_log(const struct stats_output *stats, const char *name);
+void stats_shm_log(const struct stats_shm *stats, size_t bytes_now);
@@ -0,0 +1,946 @@
+/*
+ * Minimal headless Wayland compositor for end-to-end tests of mhalo.
+ *
+ * It advertises wl_compositor, wl_shm, one wl_output, a wl_seat with a
+ * pointer and zwlr_layer_shell_v1, runs mhalo on a private connection
+ * (WAYLAND_SOCKET), feeds it scripted pointer motion and reports every
+ * commit, damage rectangle and buffer allocation it makes. Once the script
+ * is done it clicks, which makes mhalo exit, and prints a summary.
+ *
+ * Nothing is ever composited: buffers are inspected on commit and released
+ * when the next commit replaces them, and frame callbacks fire on a timer
+ * at the configured refresh rate.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <linux/input-event-codes.h>
+
+#include <wayland-server.h>
+
+#include <wlr-layer-shell-unstable-v1-server.h>
+
+#define LOG_MODULE "stub-compositor"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+static struct wl_display *display;
+static struct wl_event_loop *loop;
+static struct wl_client *client;
+static struct wl_event_source *motion_source;
+static struct wl_event_source *refresh_source;
+static struct wl_event_source *watchdog_source;
+static pid_t child = -1;
+
+static bool quiet = false;
+
+/* Script parameters */
+static int output_width = 1920;
+static int output_height = 1080;
+static int output_scale = 1;
+static int refresh_hz = 60;
+static int motion_hz = 1000;
+static unsigned long motion_count = 2000;
+
+struct surface {
+  struct wl_resource *resource;
+  struct wl_resource *layer; // zwlr_layer_surface_v1, if any
+  bool configured;
+  bool mapped;
+
+  // Pending state, applied on commit
+  struct wl_resource *pending_buffer;
+  struct wl_listener pending_buffer_destroy;
+  bool pending_attach;
+  struct wl_list pending_frames;
+  unsigned long pending_damage;
+
+  struct wl_resource *buffer;
+  struct wl_listener buffer_destroy;
+};
+
+static struct wl_list frame_callbacks; // committed, waiting for a refresh
+static struct wl_list pointers;        // wl_pointer resources
+static struct surface *focus;
+
+static struct {
+  unsigned long commits;
+  unsigned long damage_rects;
+  uint64_t damage_pixels;
+  unsigned long frames;
+
+  unsigned long pools;
+  unsigned long pool_resizes;
+  unsigned long buffers;
+  unsigned long buffers_destroyed;
+  uint64_t pool_bytes;
+
+  unsigned long motions;
+  unsigned long latency_samples;
+  uint64_t latency_sum_ns;
+  uint64_t latency_max_ns;
+} stats;
+
+/* Oldest motion event not yet answered with a commit */
+static bool motion_pending = false;
+static uint64_t motion_sent_ns;
+
+static uint64_t start_ns;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t now_ms(void) { return (uint32_t)(now_ns() / 1000000); }
+
+static void report(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void report(const char *fmt, ...) {
+  if (quiet)
+    return;
+
+  va_list va;
+  va_start(va, fmt);
+  printf("%8.3f ", (now_ns() - start_ns) / 1e9);
+  vprintf(fmt, va);
+  printf("\n");
+  va_end(va);
+}
+
+static void resource_destroy(struct wl_client *client,
+                             struct wl_resource *resource) {
+  wl_resource_destroy(resource);
+}
+
+static void unlink_resource(struct wl_resource *resource) {
+  wl_list_remove(wl_resource_get_link(resource));
+}
+
+/* wl_region: only needs to exist */
+
+static void region_add(struct wl_client *client, struct wl_resource *resource,
+                       int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void region_subtract(struct wl_client *client,
+                            struct wl_resource *resource, int32_t x, int32_t y,
+                            int32_t width, int32_t height) {}
+
+static const struct wl_region_interface region_impl = {
+    .destroy = &resource_destroy,
+    .add = &region_add,
+    .subtract = &region_subtract,
+};
+
+/* wl_surface */
+
+static void surface_pending_buffer_destroyed(struct wl_listener *listener,
+                                             void *data) {
+  struct surface *surf =
+      wl_container_of(listener, surf, pending_buffer_destroy);
+  wl_list_remove(&listener->link);
+  surf->pending_buffer = NULL;
+}
+
+static void surface_buffer_destroyed(struct wl_listener *listener,
+                                     void *data) {
+  struct surface *surf = wl_container_of(listener, surf, buffer_destroy);
+  wl_list_remove(&listener->link);
+  surf->buffer = NULL;
+}
+
+static void surface_attach(struct wl_client *client,
+                           struct wl_resource *resource,
+                           struct wl_resource *buffer, int32_t x, int32_t y) {
+  struct surface *surf = wl_resource_get_user_data(resource);
+
+  if (surf->pending_buffer != NULL)
+    wl_list_remove(&surf->pending_buffer_destroy.link);
+
+  surf->pending_buffer = buffer;
+  surf->pending_attach = true;
+
+  if (buffer != NULL) {
+    surf->pending_buffer_destroy.notify = &surface_pending_buffer_destroyed;
+    wl_resource_add_destroy_listener(buffer, &surf->pending_buffer_destroy);
+  }
+}
+
+static void surface_damage_report(struct surface *surf, const char *kind,
+                                  int32_t x, int32_t y, int32_t width,
+                                  int32_t height) {
+  stats.damage_rects++;
+  if (width > 0 && height > 0)
+    stats.damage_pixels += (uint64_t)width * height;
+
+  surf->pending_damage++;
+  report("surface@%u: %s %d,%d %dx%d", wl_resource_get_id(surf->resource),
+         kind, x, y, width, height);
+}
+
+static void surface_damage(struct wl_client *client,
+                           struct wl_resource *resource, int32_t x, int32_t y,
+                           int32_t width, int32_t height) {
+  surface_damage_report(wl_resource_get_user_data(resource), "damage", x, y,
+                        width, height);
+}
+
+static void surface_damage_buffer(struct wl_client *client,
+                                  struct wl_resource *resource, int32_t x,
+                                  int32_t y, int32_t width, int32_t height) {
+  surface_damage_report(wl_resource_get_user_data(resource), "damage_buffer",
+                        x, y, width, height);
+}
+
+static void surface_frame(struct wl_client *client,
+                          struct wl_resource *resource, uint32_t id) {
+  struct surface *surf = wl_resource_get_user_data(resource);
+
+  struct wl_resource *callback =
+      wl_resource_create(client, &wl_callback_interface, 1, id);
+  if (callback == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+
+  wl_resource_set_implementation(callback, NULL, NULL, &unlink_resource);
+  wl_list_insert(surf->pending_frames.prev, wl_resource_get_link(callback));
+}
+
+static void surface_set_region(struct wl_client *client,
+                               struct wl_resource *resource,
+                               struct wl_resource *region) {}
+
+static void pointer_enter_surface(struct surface *surf);
+
+static void surface_commit(struct wl_client *client,
+                           struct wl_resource *resource) {
+  struct surface *surf = wl_resource_get_user_data(resource);
+
+  if (surf->layer != NULL && !surf->configured) {
+    // Initial commit of a layer surface: configure it to the output size
+    surf->configured = true;
+    zwlr_layer_surface_v1_send_configure(surf->layer,
+                                         wl_display_next_serial(display),
+                                         output_width, output_height);
+    report("surface@%u: configure %dx%d", wl_resource_get_id(resource),
+           output_width, output_height);
+  }
+
+  if (surf->pending_attach) {
+    // The replaced buffer is no longer read from
+    if (surf->buffer != NULL) {
+      wl_list_remove(&surf->buffer_destroy.link);
+      if (surf->buffer != surf->pending_buffer)
+        wl_buffer_send_release(surf->buffer);
+    }
+
+    surf->buffer = surf->pending_buffer;
+    if (surf->buffer != NULL) {
+      surf->buffer_destroy.notify = &surface_buffer_destroyed;
+      wl_resource_add_destroy_listener(surf->buffer, &surf->buffer_destroy);
+    }
+
+    if (surf->pending_buffer != NULL)
+      wl_list_remove(&surf->pending_buffer_destroy.link);
+    surf->pending_buffer = NULL;
+    surf->pending_attach = false;
+  }
+
+  stats.commits++;
+
+  struct wl_shm_buffer *shm_buffer =
+      surf->buffer != NULL ? wl_shm_buffer_get(surf->buffer) : NULL;
+  if (shm_buffer != NULL) {
+    report("surface@%u: commit buffer@%u %dx%d, %lu damage rects",
+           wl_resource_get_id(resource), wl_resource_get_id(surf->buffer),
+           wl_shm_buffer_get_width(shm_buffer),
+           wl_shm_buffer_get_height(shm_buffer), surf->pending_damage);
+  } else {
+    report("surface@%u: commit, %lu damage rects",
+           wl_resource_get_id(resource), surf->pending_damage);
+  }
+  surf->pending_damage = 0;
+
+  if (surf == focus && motion_pending) {
+    const uint64_t latency = now_ns() - motion_sent_ns;
+    motion_pending = false;
+    stats.latency_samples++;
+    stats.latency_sum_ns += latency;
+    if (latency > stats.latency_max_ns)
+      stats.latency_max_ns = latency;
+  }
+
+  wl_list_insert_list(frame_callbacks.prev, &surf->pending_frames);
+  wl_list_init(&surf->pending_frames);
+
+  if (surf->layer != NULL && surf->buffer != NULL && !surf->mapped) {
+    surf->mapped = true;
+    if (focus == NULL)
+      pointer_enter_surface(surf);
+  }
+}
+
+static void surface_set_buffer_transform(struct wl_client *client,
+                                         struct wl_resource *resource,
+                                         int32_t transform) {}
+
+static void surface_set_buffer_scale(struct wl_client *client,
+                                     struct wl_resource *resource,
+                                     int32_t scale) {}
+
+static void surface_offset(struct wl_client *client,
+                           struct wl_resource *resource, int32_t x, int32_t y) {
+}
+
+static const struct wl_surface_interface surface_impl = {
+    .destroy = &resource_destroy,
+    .attach = &surface_attach,
+    .damage = &surface_damage,
+    .frame = &surface_frame,
+    .set_opaque_region = &surface_set_region,
+    .set_input_region = &surface_set_region,
+    .commit = &surface_commit,
+    .set_buffer_transform = &surface_set_buffer_transform,
+    .set_buffer_scale = &surface_set_buffer_scale,
+    .damage_buffer = &surface_damage_buffer,
+    .offset = &surface_offset,
+};
+
+static void surface_destroy(struct wl_resource *resource) {
+  struct surface *surf = wl_resource_get_user_data(resource);
+
+  if (surf == focus)
+    focus = NULL;
+  if (surf->pending_buffer != NULL)
+    wl_list_remove(&surf->pending_buffer_destroy.link);
+  if (surf->buffer != NULL)
+    wl_list_remove(&surf->buffer_destroy.link);
+
+  struct wl_resource *cb, *tmp;
+  wl_resource_for_each_safe(cb, tmp, &surf->pending_frames)
+      wl_resource_destroy(cb);
+
+  if (surf->layer != NULL)
+    wl_resource_set_user_data(surf->layer, NULL);
+  free(surf);
+}
+
+/* wl_compositor */
+
+static void compositor_create_surface(struct wl_client *client,
+                                      struct wl_resource *resource,
+                                      uint32_t id) {
+  struct surface *surf = calloc(1, sizeof(*surf));
+  if (surf == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+
+  surf->resource = wl_resource_create(client, &wl_surface_interface,
+                                      wl_resource_get_version(resource), id);
+  if (surf->resource == NULL) {
+    free(surf);
+    wl_client_post_no_memory(client);
+    return;
+  }
+
+  wl_list_init(&surf->pending_frames);
+  wl_resource_set_implementation(surf->resource, &surface_impl, surf,
+                                 &surface_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client,
+                                     struct wl_resource *resource,
+                                     uint32_t id) {
+  struct wl_resource *region = wl_resource_create(
+      client, &wl_region_interface, wl_resource_get_version(resource), id);
+  if (region == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+    .create_surface = &compositor_create_surface,
+    .create_region = &compositor_create_region,
+};
+
+static void compositor_bind(struct wl_client *client, void *data,
+                            uint32_t version, uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &wl_compositor_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &compositor_impl, NULL, NULL);
+}
+
+/* wl_output */
+
+static void output_release(struct wl_client *client,
+                           struct wl_resource *resource) {
+  wl_resource_destroy(resource);
+}
+
+static const struct wl_output_interface output_impl = {
+    .release = &output_release,
+};
+
+static void output_bind(struct wl_client *client, void *data, uint32_t version,
+                        uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &wl_output_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &output_impl, NULL, NULL);
+
+  wl_output_send_geometry(resource, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+                          "mhalo", "stub", WL_OUTPUT_TRANSFORM_NORMAL);
+  wl_output_send_mode(resource, WL_OUTPUT_MODE_CURRENT,
+                      output_width * output_scale,
+                      output_height * output_scale, refresh_hz * 1000);
+  wl_output_send_scale(resource, output_scale);
+  wl_output_send_done(resource);
+}
+
+/* wl_seat and wl_pointer */
+
+static void pointer_set_cursor(struct wl_client *client,
+                               struct wl_resource *resource, uint32_t serial,
+                               struct wl_resource *surface, int32_t hotspot_x,
+                               int32_t hotspot_y) {}
+
+static const struct wl_pointer_interface pointer_impl = {
+    .set_cursor = &pointer_set_cursor,
+    .release = &resource_destroy,
+};
+
+static void seat_get_pointer(struct wl_client *client,
+                             struct wl_resource *resource, uint32_t id) {
+  struct wl_resource *pointer = wl_resource_create(
+      client, &wl_pointer_interface, wl_resource_get_version(resource), id);
+  if (pointer == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+
+  wl_resource_set_implementation(pointer, &pointer_impl, NULL,
+                                 &unlink_resource);
+  wl_list_insert(&pointers, wl_resource_get_link(pointer));
+}
+
+static void seat_get_keyboard(struct wl_client *client,
+                              struct wl_resource *resource, uint32_t id) {
+  wl_resource_post_error(resource, 0, "no keyboard");
+}
+
+static void seat_get_touch(struct wl_client *client,
+                           struct wl_resource *resource, uint32_t id) {
+  wl_resource_post_error(resource, 0, "no touch");
+}
+
+static const struct wl_seat_interface seat_impl = {
+    .get_pointer = &seat_get_pointer,
+    .get_keyboard = &seat_get_keyboard,
+    .get_touch = &seat_get_touch,
+    .release = &resource_destroy,
+};
+
+static void seat_bind(struct wl_client *client, void *data, uint32_t version,
+                      uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &wl_seat_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &seat_impl, NULL, NULL);
+
+  wl_seat_send_capabilities(resource, WL_SEAT_CAPABILITY_POINTER);
+  if (version >= WL_SEAT_NAME_SINCE_VERSION)
+    wl_seat_send_name(resource, "seat0");
+}
+
+static void pointer_send_frame(struct wl_resource *pointer) {
+  if (wl_resource_get_version(pointer) >= WL_POINTER_FRAME_SINCE_VERSION)
+    wl_pointer_send_frame(pointer);
+}
+
+static void pointer_enter_surface(struct surface *surf) {
+  focus = surf;
+
+  struct wl_resource *pointer;
+  wl_resource_for_each(pointer, &pointers) {
+    wl_pointer_send_enter(pointer, wl_display_next_serial(display),
+                          surf->resource, wl_fixed_from_int(output_width / 2),
+                          wl_fixed_from_int(output_height / 2));
+    pointer_send_frame(pointer);
+  }
+  report("pointer: enter surface@%u", wl_resource_get_id(surf->resource));
+}
+
+static void pointer_click(void) {
+  struct wl_resource *pointer;
+  wl_resource_for_each(pointer, &pointers) {
+    const uint32_t time = now_ms();
+    wl_pointer_send_button(pointer, wl_display_next_serial(display), time,
+                           BTN_LEFT, WL_POINTER_BUTTON_STATE_PRESSED);
+    pointer_send_frame(pointer);
+    wl_pointer_send_button(pointer, wl_display_next_serial(display), time,
+                           BTN_LEFT, WL_POINTER_BUTTON_STATE_RELEASED);
+    pointer_send_frame(pointer);
+  }
+  report("pointer: click");
+}
+
+/*
+ * The script: a Lissajous figure across most of the output, which moves
+ * the halo both slowly and quickly, one motion event per device report.
+ */
+static int motion_interval_ms(void) {
+  return 1000 / motion_hz > 0 ? 1000 / motion_hz : 1;
+}
+
+static int motion_timer(void *data) {
+  if (focus == NULL) {
+    wl_event_source_timer_update(motion_source, motion_interval_ms());
+    return 0;
+  }
+
+  if (stats.motions >= motion_count) {
+    pointer_click();
+    return 0;
+  }
+
+  const double t = (double)stats.motions / motion_hz;
+  const double x = output_width / 2. * (1. + 0.9 * sin(2. * M_PI * 0.5 * t));
+  const double y = output_height / 2. * (1. + 0.9 * sin(2. * M_PI * 0.3 * t));
+
+  struct wl_resource *pointer;
+  wl_resource_for_each(pointer, &pointers) {
+    wl_pointer_send_motion(pointer, now_ms(), wl_fixed_from_double(x),
+                           wl_fixed_from_double(y));
+    pointer_send_frame(pointer);
+  }
+
+  if (!motion_pending) {
+    motion_pending = true;
+    motion_sent_ns = now_ns();
+  }
+  stats.motions++;
+
+  wl_event_source_timer_update(motion_source, motion_interval_ms());
+  return 0;
+}
+
+/* Refresh cycle: fire all frame callbacks committed since the last one */
+static int refresh_timer(void *data) {
+  if (!wl_list_empty(&frame_callbacks)) {
+    const uint32_t time = now_ms();
+    struct wl_resource *cb, *tmp;
+    wl_resource_for_each_safe(cb, tmp, &frame_callbacks) {
+      wl_callback_send_done(cb, time);
+      wl_resource_destroy(cb);
+    }
+    stats.frames++;
+  }
+
+  wl_event_source_timer_update(refresh_source, 1000 / refresh_hz);
+  return 0;
+}
+
+/* zwlr_layer_shell_v1 */
+
+static void layer_surface_set_size(struct wl_client *client,
+                                   struct wl_resource *resource, uint32_t width,
+                                   uint32_t height) {}
+
+static void layer_surface_set_anchor(struct wl_client *client,
+                                     struct wl_resource *resource,
+                                     uint32_t anchor) {}
+
+static void layer_surface_set_exclusive_zone(struct wl_client *client,
+                                             struct wl_resource *resource,
+                                             int32_t zone) {}
+
+static void layer_surface_set_margin(struct wl_client *client,
+                                     struct wl_resource *resource, int32_t top,
+                                     int32_t right, int32_t bottom,
+                                     int32_t left) {}
+
+static void layer_surface_set_keyboard_interactivity(
+    struct wl_client *client, struct wl_resource *resource,
+    uint32_t keyboard_interactivity) {}
+
+static void layer_surface_get_popup(struct wl_client *client,
+                                    struct wl_resource *resource,
+                                    struct wl_resource *popup) {}
+
+static void layer_surface_ack_configure(struct wl_client *client,
+                                        struct wl_resource *resource,
+                                        uint32_t serial) {}
+
+static void layer_surface_set_layer(struct wl_client *client,
+                                    struct wl_resource *resource,
+                                    uint32_t layer) {}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
+    .set_size = &layer_surface_set_size,
+    .set_anchor = &layer_surface_set_anchor,
+    .set_exclusive_zone = &layer_surface_set_exclusive_zone,
+    .set_margin = &layer_surface_set_margin,
+    .set_keyboard_interactivity = &layer_surface_set_keyboard_interactivity,
+    .get_popup = &layer_surface_get_popup,
+    .ack_configure = &layer_surface_ack_configure,
+    .destroy = &resource_destroy,
+    .set_layer = &layer_surface_set_layer,
+};
+
+static void layer_surface_destroy(struct wl_resource *resource) {
+  struct surface *surf = wl_resource_get_user_data(resource);
+  if (surf != NULL) {
+    surf->layer = NULL;
+    surf->configured = false;
+    surf->mapped = false;
+  }
+}
+
+static void layer_shell_get_layer_surface(
+    struct wl_client *client, struct wl_resource *resource, uint32_t id,
+    struct wl_resource *surface, struct wl_resource *output, uint32_t layer,
+    const char *namespace) {
+  struct surface *surf = wl_resource_get_user_data(surface);
+
+  struct wl_resource *layer_surface =
+      wl_resource_create(client, &zwlr_layer_surface_v1_interface,
+                         wl_resource_get_version(resource), id);
+  if (layer_surface == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+
+  wl_resource_set_implementation(layer_surface, &layer_surface_impl, surf,
+                                 &layer_surface_destroy);
+  surf->layer = layer_surface;
+  report("surface@%u: layer surface \"%s\"", wl_resource_get_id(surface),
+         namespace);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+    .get_layer_surface = &layer_shell_get_layer_surface,
+    .destroy = &resource_destroy,
+};
+
+static void layer_shell_bind(struct wl_client *client, void *data,
+                             uint32_t version, uint32_t id) {
+  struct wl_resource *resource =
+      wl_resource_create(client, &zwlr_layer_shell_v1_interface, version, id);
+  if (resource == NULL) {
+    wl_client_post_no_memory(client);
+    return;
+  }
+  wl_resource_set_implementation(resource, &layer_shell_impl, NULL, NULL);
+}
+
+/* Buffer allocations happen in libwayland's wl_shm; watch the requests */
+static void protocol_logger(void *user_data,
+                            enum wl_protocol_logger_type direction,
+                            const struct wl_protocol_logger_message *message) {
+  if (direction != WL_PROTOCOL_LOGGER_REQUEST)
+    return;
+
+  const char *class = wl_resource_get_class(message->resource);
+  const char *name = message->message->name;
+  const union wl_argument *args = message->arguments;
+
+  if (strcmp(class, "wl_shm") == 0 && strcmp(name, "create_pool") == 0) {
+    stats.pools++;
+    stats.pool_bytes += args[2].i;
+    report("shm: create_pool wl_shm_pool@%u, %d bytes", args[0].n, args[2].i);
+  } else if (strcmp(class, "wl_shm_pool") == 0 &&
+             strcmp(name, "resize") == 0) {
+    stats.pool_resizes++;
+    report("shm: resize wl_shm_pool@%u, %d bytes",
+           wl_resource_get_id(message->resource), args[0].i);
+  } else if (strcmp(class, "wl_shm_pool") == 0 &&
+             strcmp(name, "create_buffer") == 0) {
+    stats.buffers++;
+    report("shm: create_buffer buffer@%u %dx%d, offset %d, stride %d",
+           args[0].n, args[2].i, args[3].i, args[1].i, args[4].i);
+  } else if (strcmp(class, "wl_buffer") == 0 &&
+             strcmp(name, "destroy") == 0) {
+    stats.buffers_destroyed++;
+    report("shm: destroy buffer@%u", wl_resource_get_id(message->resource));
+  }
+}
+
+static void client_destroyed(struct wl_listener *listener, void *data) {
+  client = NULL;
+  wl_display_terminate(display);
+}
+
+static struct wl_listener client_destroy_listener = {
+    .notify = &client_destroyed,
+};
+
+static int watchdog_timer(void *data) {
+  LOG_ERR("timed out waiting for mhalo");
+  if (child > 0)
+    kill(child, SIGTERM);
+  wl_display_terminate(display);
+  return 0;
+}
+
+static pid_t spawn(char *const *argv, int fd) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  // Child: the fd must survive exec, and nothing may reach a real session
+  int client_fd = dup(fd);
+  if (client_fd < 0)
+    _exit(127);
+
+  char fd_str[16];
+  snprintf(fd_str, sizeof(fd_str), "%d", client_fd);
+  setenv("WAYLAND_SOCKET", fd_str, 1);
+  unsetenv("WAYLAND_DISPLAY");
+
+  execv(argv[0], argv);
+  fprintf(stderr, "error: %s: %s\n", argv[0], strerror(errno));
+  _exit(127);
+}
+
+static void print_summary(double elapsed) {
+  printf("summary: %.2f s\n", elapsed);
+  printf("  motion:  %lu events (%.0f/s)\n", stats.motions,
+         stats.motions / elapsed);
+  printf("  commits: %lu (%.1f/s), %lu refreshes with frame callbacks\n",
+         stats.commits, stats.commits / elapsed, stats.frames);
+  printf("  damage:  %lu rects, %.1f Mpixels, %.0f pixels/commit\n",
+         stats.damage_rects, stats.damage_pixels / 1e6,
+         stats.commits > 0 ? (double)stats.damage_pixels / stats.commits : 0.);
+  printf("  shm:     %lu pools (%lu resizes, %.1f MiB at creation), "
+         "%lu buffers created, %lu destroyed\n",
+         stats.pools, stats.pool_resizes, stats.pool_bytes / 1048576.,
+         stats.buffers, stats.buffers_destroyed);
+  if (stats.latency_samples > 0) {
+    printf("  motion to commit: avg %.2f ms, max %.2f ms (%lu samples)\n",
+           stats.latency_sum_ns / 1e6 / stats.latency_samples,
+           stats.latency_max_ns / 1e6, stats.latency_samples);
+  }
+}
+
+static void usage(const char *progname) {
+  printf("Usage: %s [OPTIONS] MHALO [MHALO-OPTIONS]\n"
+         "\n"
+         "Options:\n"
+         "  -n,--motions=N       pointer motion events to send (%lu)\n"
+         "  -r,--rate=HZ         pointer motion rate (%d)\n"
+         "  -R,--refresh=HZ      output refresh rate (%d)\n"
+         "  -m,--mode=WxH        logical output size (%dx%d)\n"
+         "  -s,--scale=N         output scale (%d)\n"
+         "  -q,--quiet           only print the summary\n",
+         progname, motion_count, motion_hz, refresh_hz, output_width,
+         output_height, output_scale);
+}
+
+int main(int argc, char *const *argv) {
+  const char *progname = argv[0];
+
+  const struct option longopts[] = {
+      {"motions", required_argument, 0, 'n'},
+      {"rate", required_argument, 0, 'r'},
+      {"refresh", required_argument, 0, 'R'},
+      {"mode", required_argument, 0, 'm'},
+      {"scale", required_argument, 0, 's'},
+      {"quiet", no_argument, 0, 'q'},
+      {"help", no_argument, 0, 'h'},
+      {NULL, no_argument, 0, 0},
+  };
+
+  while (true) {
+    // '+': stop at MHALO, its options are passed on untouched
+    int c = getopt_long(argc, argv, "+n:r:R:m:s:qh", longopts, NULL);
+    if (c < 0)
+      break;
+
+    switch (c) {
+    case 'n':
+      motion_count = strtoul(optarg, NULL, 10);
+      break;
+
+    case 'r':
+      motion_hz = atoi(optarg);
+      break;
+
+    case 'R':
+      refresh_hz = atoi(optarg);
+      break;
+
+    case 'm':
+      if (sscanf(optarg, "%dx%d", &output_width, &output_height) != 2) {
+        fprintf(stderr, "error: -m: invalid mode: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 's':
+      output_scale = atoi(optarg);
+      break;
+
+    case 'q':
+      quiet = true;
+      break;
+
+    case 'h':
+      usage(progname);
+      return EXIT_SUCCESS;
+
+    case '?':
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind >= argc || motion_hz <= 0 || refresh_hz <= 0 ||
+      output_width <= 0 || output_height <= 0 || output_scale <= 0) {
+    usage(progname);
+    return EXIT_FAILURE;
+  }
+
+  log_init(LOG_COLORIZE_AUTO, false, LOG_FACILITY_USER, LOG_CLASS_WARNING);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  int exit_code = EXIT_FAILURE;
+  int fds[2] = {-1, -1};
+
+  wl_list_init(&frame_callbacks);
+  wl_list_init(&pointers);
+
+  display = wl_display_create();
+  if (display == NULL) {
+    LOG_ERR("failed to create display");
+    goto out;
+  }
+
+  loop = wl_display_get_event_loop(display);
+
+  if (wl_display_init_shm(display) < 0 ||
+      wl_global_create(display, &wl_compositor_interface, 4, NULL,
+                       &compositor_bind) == NULL ||
+      wl_global_create(display, &wl_output_interface, 3, NULL, &output_bind) ==
+          NULL ||
+      wl_global_create(display, &wl_seat_interface, 5, NULL, &seat_bind) ==
+          NULL ||
+      wl_global_create(display, &zwlr_layer_shell_v1_interface, 2, NULL,
+                       &layer_shell_bind) == NULL) {
+    LOG_ERR("failed to create globals");
+    goto out;
+  }
+
+  wl_display_add_protocol_logger(display, &protocol_logger, NULL);
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    LOG_ERRNO("failed to create socket pair");
+    goto out;
+  }
+
+  client = wl_client_create(display, fds[0]);
+  if (client == NULL) {
+    LOG_ERR("failed to create client");
+    goto out;
+  }
+  fds[0] = -1;
+  wl_client_add_destroy_listener(client, &client_destroy_listener);
+
+  start_ns = now_ns();
+
+  child = spawn(&argv[optind], fds[1]);
+  if (child < 0) {
+    LOG_ERRNO("failed to fork");
+    goto out;
+  }
+  close(fds[1]);
+  fds[1] = -1;
+
+  motion_source = wl_event_loop_add_timer(loop, &motion_timer, NULL);
+  refresh_source = wl_event_loop_add_timer(loop, &refresh_timer, NULL);
+  watchdog_source = wl_event_loop_add_timer(loop, &watchdog_timer, NULL);
+  if (motion_source == NULL || refresh_source == NULL ||
+      watchdog_source == NULL) {
+    LOG_ERR("failed to create timers");
+    goto out;
+  }
+
+  // The script plus ten seconds of slack
+  wl_event_source_timer_update(motion_source, motion_interval_ms());
+  wl_event_source_timer_update(refresh_source, 1000 / refresh_hz);
+  wl_event_source_timer_update(watchdog_source,
+                               motion_count * 1000 / motion_hz + 10000);
+
+  wl_display_run(display);
+
+  const double elapsed = (now_ns() - start_ns) / 1e9;
+
+  int status;
+  if (waitpid(child, &status, 0) < 0) {
+    LOG_ERRNO("failed to wait for mhalo");
+    goto out;
+  }
+  child = -1;
+
+  print_summary(elapsed);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    LOG_ERR("mhalo failed (status %d)", status);
+    goto out;
+  }
+  if (stats.commits == 0 || stats.motions < motion_count) {
+    LOG_ERR("mhalo did not run through the script");
+    goto out;
+  }
+
+  exit_code = EXIT_SUCCESS;
+
+out:
+  if (child > 0) {
+    kill(child, SIGTERM);
+    waitpid(child, NULL, 0);
+  }
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+  if (motion_source != NULL)
+    wl_event_source_remove(motion_source);
+  if (refresh_source != NULL)
+    wl_event_source_remove(refresh_source);
+  if (watchdog_source != NULL)
+    wl_event_source_remove(watchdog_source);
+  if (display != NULL) {
+    if (client != NULL)
+      wl_client_destroy(client);
+    wl_display_destroy(display);
+  }
+  log_deinit();
+  return exit_code;
+}
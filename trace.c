@@ -0,0 +1,125 @@
+#include "trace.h"
+
+#if defined(MHALO_TRACE)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#define LOG_MODULE "trace"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+struct trace_record trace_ring[TRACE_RING_SIZE];
+atomic_uint_fast64_t trace_head;
+_Thread_local uint32_t trace_tid;
+
+static const struct {
+  const char *name;
+  const char *args[2]; // NULL if unused
+} events[TRACE_EVENT_COUNT] = {
+    [TRACE_RENDER] = {"render", {"frame", "frame_done"}},
+    [TRACE_PAINT] = {"paint", {"jobs", NULL}},
+    [TRACE_PAINT_JOB] = {"paint_job", {"y1", "y2"}},
+    [TRACE_BUFFER_ACQUIRE] = {"buffer_acquire", {"slot", "created"}},
+    [TRACE_BUFFER_RELEASE] = {"buffer_release", {"slot", "stale"}},
+    [TRACE_FRAME_DONE] = {"frame_done", {"frame", "wants_render"}},
+    [TRACE_POINTER_ENTER] = {"pointer_enter", {"x", "y"}},
+    [TRACE_POINTER_LEAVE] = {"pointer_leave", {NULL, NULL}},
+    [TRACE_POINTER_MOTION] = {"pointer_motion", {"x", "y"}},
+    [TRACE_POINTER_BUTTON] = {"pointer_button", {"button", "state"}},
+    [TRACE_POINTER_FRAME] = {"pointer_frame", {NULL, NULL}},
+};
+
+static const char phases[] = {
+    [TRACE_PHASE_INSTANT] = 'i',
+    [TRACE_PHASE_BEGIN] = 'B',
+    [TRACE_PHASE_END] = 'E',
+};
+
+// Calibration point for converting ticks to CLOCK_MONOTONIC
+static uint64_t start_ticks;
+static uint64_t start_ns;
+static unsigned dumps;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint32_t trace_thread_id(void) {
+  trace_tid = syscall(SYS_gettid);
+  return trace_tid;
+}
+
+void trace_init(void) {
+  start_ns = monotonic_ns();
+  start_ticks = trace_clock();
+}
+
+void trace_dump(void) {
+  // Ticks per nanosecond, measured over the whole run so far
+  const uint64_t now_ns = monotonic_ns();
+  const uint64_t now_ticks = trace_clock();
+  const double ns_per_tick = now_ticks > start_ticks
+                                 ? (double)(now_ns - start_ns) /
+                                       (now_ticks - start_ticks)
+                                 : 1.;
+
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/mhalo-%d-%u.trace.json",
+           dir != NULL ? dir : "/tmp", (int)getpid(), dumps++);
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    LOG_ERRNO("%s: failed to open", path);
+    return;
+  }
+
+  const uint64_t head =
+      atomic_load_explicit(&trace_head, memory_order_relaxed);
+  const uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  const int pid = getpid();
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(f,
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"mhalo\"}}",
+          pid);
+
+  for (uint64_t i = first; i < head; i++) {
+    const struct trace_record *r = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+    const double ts_us =
+        (start_ns + ((int64_t)(r->ticks - start_ticks)) * ns_per_tick) / 1e3;
+
+    fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"mhalo\",\"ph\":\"%c\","
+               "\"ts\":%.3f,\"pid\":%d,\"tid\":%u",
+            events[r->event].name, phases[r->phase], ts_us, pid, r->tid);
+    if (r->phase == TRACE_PHASE_INSTANT)
+      fprintf(f, ",\"s\":\"t\"");
+
+    const char *const *args = events[r->event].args;
+    if (args[0] != NULL) {
+      fprintf(f, ",\"args\":{\"%s\":%d", args[0], r->args[0]);
+      if (args[1] != NULL)
+        fprintf(f, ",\"%s\":%d", args[1], r->args[1]);
+      fprintf(f, "}");
+    }
+    fprintf(f, "}");
+  }
+  fprintf(f, "\n]}\n");
+
+  if (fclose(f) != 0) {
+    LOG_ERRNO("%s: failed to write", path);
+    return;
+  }
+
+  LOG_INFO("%s: %llu of %llu trace events", path,
+           (unsigned long long)(head - first), (unsigned long long)head);
+}
+
+#endif
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Trace points on the render and input paths. Built with -Dtrace=true,
+ * each one appends a fixed-size binary record to a lock-free ring; the most
+ * recent TRACE_RING_SIZE records are written out as Chrome trace JSON (for
+ * chrome://tracing or ui.perfetto.dev) by trace_dump(). Otherwise they
+ * compile to nothing.
+ */
+
+enum trace_event {
+  TRACE_RENDER,         // render() was asked to draw an output
+  TRACE_PAINT,          // render_flush(): prepare, paint and commit a batch
+  TRACE_PAINT_JOB,      // one band or box, on any thread
+  TRACE_BUFFER_ACQUIRE, // shm_swapchain_acquire()
+  TRACE_BUFFER_RELEASE, // wl_buffer.release
+  TRACE_FRAME_DONE,     // wl_surface.frame callback
+  TRACE_POINTER_ENTER,
+  TRACE_POINTER_LEAVE,
+  TRACE_POINTER_MOTION,
+  TRACE_POINTER_BUTTON,
+  TRACE_POINTER_FRAME,
+  TRACE_EVENT_COUNT,
+};
+
+enum trace_phase {
+  TRACE_PHASE_INSTANT,
+  TRACE_PHASE_BEGIN,
+  TRACE_PHASE_END,
+};
+
+#if defined(MHALO_TRACE)
+
+#include <stdatomic.h>
+#include <time.h>
+
+#define TRACE_RING_SIZE (1u << 16) // a power of two
+
+struct trace_record {
+  uint64_t ticks; // trace_clock()
+  uint32_t tid;
+  uint8_t event;
+  uint8_t phase;
+  int32_t args[2];
+};
+
+extern struct trace_record trace_ring[TRACE_RING_SIZE];
+extern atomic_uint_fast64_t trace_head;
+extern _Thread_local uint32_t trace_tid;
+
+uint32_t trace_thread_id(void);
+
+void trace_init(void);
+
+/*
+ * Write the records still in the ring to a new file in $XDG_RUNTIME_DIR
+ * (or /tmp). Call while no other thread is recording.
+ */
+void trace_dump(void);
+
+/* The TSC where there is one; it is calibrated against CLOCK_MONOTONIC */
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static inline void trace_record(enum trace_event event, enum trace_phase phase,
+                                int32_t arg0, int32_t arg1) {
+  const uint_fast64_t i =
+      atomic_fetch_add_explicit(&trace_head, 1, memory_order_relaxed);
+  struct trace_record *r = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+
+  r->ticks = trace_clock();
+  r->tid = trace_tid != 0 ? trace_tid : trace_thread_id();
+  r->event = event;
+  r->phase = phase;
+  r->args[0] = arg0;
+  r->args[1] = arg1;
+}
+
+#define TRACE(event, arg0, arg1)                                               \
+  trace_record(event, TRACE_PHASE_INSTANT, arg0, arg1)
+#define TRACE_BEGIN(event, arg0, arg1)                                         \
+  trace_record(event, TRACE_PHASE_BEGIN, arg0, arg1)
+#define TRACE_END(event, arg0, arg1)                                           \
+  trace_record(event, TRACE_PHASE_END, arg0, arg1)
+
+#else
+
+static inline void trace_init(void) {}
+static inline void trace_dump(void) {}
+
+#define TRACE(event, arg0, arg1) ((void)(arg0), (void)(arg1))
+#define TRACE_BEGIN(event, arg0, arg1) ((void)(arg0), (void)(arg1))
+#define TRACE_END(event, arg0, arg1) ((void)(arg0), (void)(arg1))
+
+#endif
@@ -0,0 +1,136 @@
+#include "workers.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define LOG_MODULE "workers"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+static pthread_t *threads = NULL;
+static size_t thread_count = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+
+// Protected by 'lock'
+static unsigned long generation = 0;
+static size_t busy = 0; // workers still in the current batch
+static bool quit = false;
+
+// Set before a batch is started, read-only while it runs
+static worker_fn batch_fn;
+static void *batch_data;
+static size_t batch_count;
+static atomic_size_t batch_next;
+
+static void run_batch(void) {
+  size_t i;
+  while ((i = atomic_fetch_add_explicit(&batch_next, 1,
+                                        memory_order_relaxed)) < batch_count)
+    batch_fn(batch_data, i);
+}
+
+static void *worker_main(void *arg) {
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (!quit && generation == seen)
+      pthread_cond_wait(&batch_start, &lock);
+    if (quit)
+      break;
+
+    seen = generation;
+    pthread_mutex_unlock(&lock);
+
+    run_batch();
+
+    pthread_mutex_lock(&lock);
+    if (--busy == 0)
+      pthread_cond_signal(&batch_done);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+bool workers_init(size_t count) {
+  if (count == 0)
+    return true;
+
+  threads = calloc(count, sizeof(threads[0]));
+  if (threads == NULL) {
+    LOG_ERRNO("failed to allocate %zu threads", count);
+    return false;
+  }
+
+  // Signals are handled by the main thread, through the signal FD
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+
+  bool ok = true;
+  for (; thread_count < count; thread_count++) {
+    int err = pthread_create(&threads[thread_count], NULL, &worker_main, NULL);
+    if (err != 0) {
+      LOG_ERRNO_P("failed to start a worker thread", err);
+      ok = false;
+      break;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (!ok) {
+    workers_fini();
+    return false;
+  }
+
+  LOG_DBG("started %zu worker threads", thread_count);
+  return true;
+}
+
+void workers_fini(void) {
+  pthread_mutex_lock(&lock);
+  quit = true;
+  pthread_cond_broadcast(&batch_start);
+  pthread_mutex_unlock(&lock);
+
+  for (size_t i = 0; i < thread_count; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  threads = NULL;
+  thread_count = 0;
+  quit = false;
+}
+
+size_t workers_count(void) { return thread_count; }
+
+void workers_run(worker_fn fn, void *data, size_t count) {
+  if (thread_count == 0 || count <= 1) {
+    for (size_t i = 0; i < count; i++)
+      fn(data, i);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  batch_fn = fn;
+  batch_data = data;
+  batch_count = count;
+  atomic_store_explicit(&batch_next, 0, memory_order_relaxed);
+  busy = thread_count;
+  generation++;
+  pthread_cond_broadcast(&batch_start);
+  pthread_mutex_unlock(&lock);
+
+  run_batch();
+
+  pthread_mutex_lock(&lock);
+  while (busy > 0)
+    pthread_cond_wait(&batch_done, &lock);
+  pthread_mutex_unlock(&lock);
+}
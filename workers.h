@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A fixed pool of threads for pixel work. The caller hands out a batch of
+ * independent jobs and takes part in it; workers_run() returns once all of
+ * them are done. Workers never touch Wayland objects.
+ */
+
+typedef void (*worker_fn)(void *data, size_t index);
+
+/* Start 'count' threads in addition to the caller; 0 runs everything inline */
+bool workers_init(size_t count);
+void workers_fini(void);
+
+size_t workers_count(void);
+
+/* Call fn(data, i) for every i < count, spread over the threads */
+void workers_run(worker_fn fn, void *data, size_t count);
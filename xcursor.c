@@ -0,0 +1,217 @@
+#include "xcursor.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_MODULE "xcursor"
+#define LOG_ENABLE_DBG 0
+#include "log.h"
+
+#define XCURSOR_MAGIC 0x72756358u // "Xcur"
+#define XCURSOR_IMAGE_TYPE 0xfffd0002u
+#define XCURSOR_MAX_TOC 0x10000u
+#define XCURSOR_MAX_SIZE 0x7fffu
+
+// libXcursor's default search path
+#define XCURSOR_PATH                                                           \
+  "~/.local/share/icons:~/.icons:/usr/share/icons:/usr/share/pixmaps"
+
+#define INHERIT_DEPTH 4
+
+static bool read_u32(FILE *f, uint32_t *value) {
+  uint8_t b[4];
+  if (fread(b, 1, sizeof(b), f) != sizeof(b))
+    return false;
+
+  *value = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+  return true;
+}
+
+static bool read_image(FILE *f, struct xcursor_image *image, int size) {
+  uint32_t magic, header, version, ntoc;
+  if (!read_u32(f, &magic) || magic != XCURSOR_MAGIC || !read_u32(f, &header) ||
+      !read_u32(f, &version) || !read_u32(f, &ntoc) || ntoc > XCURSOR_MAX_TOC ||
+      fseek(f, header, SEEK_SET) != 0)
+    return false;
+
+  // First image of the nominal size closest to the one asked for
+  uint32_t best_size = 0, best_pos = 0;
+  for (uint32_t i = 0; i < ntoc; i++) {
+    uint32_t type, subtype, position;
+    if (!read_u32(f, &type) || !read_u32(f, &subtype) ||
+        !read_u32(f, &position))
+      return false;
+    if (type != XCURSOR_IMAGE_TYPE)
+      continue;
+
+    if (best_pos == 0 ||
+        abs((int)subtype - size) < abs((int)best_size - size)) {
+      best_size = subtype;
+      best_pos = position;
+    }
+  }
+  if (best_pos == 0)
+    return false;
+
+  uint32_t chunk[9]; // header, type, size, version, w, h, xhot, yhot, delay
+  if (fseek(f, best_pos, SEEK_SET) != 0)
+    return false;
+  for (size_t i = 0; i < 9; i++) {
+    if (!read_u32(f, &chunk[i]))
+      return false;
+  }
+
+  const uint32_t width = chunk[4], height = chunk[5];
+  const uint32_t hot_x = chunk[6], hot_y = chunk[7];
+  if (chunk[1] != XCURSOR_IMAGE_TYPE || width == 0 || height == 0 ||
+      width > XCURSOR_MAX_SIZE || height > XCURSOR_MAX_SIZE || hot_x > width ||
+      hot_y > height || fseek(f, best_pos + chunk[0], SEEK_SET) != 0)
+    return false;
+
+  uint32_t *pixels = malloc((size_t)width * height * sizeof(pixels[0]));
+  if (pixels == NULL)
+    return false;
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    if (!read_u32(f, &pixels[i])) {
+      free(pixels);
+      return false;
+    }
+  }
+
+  *image = (struct xcursor_image){
+      .width = width,
+      .height = height,
+      .hot_x = hot_x,
+      .hot_y = hot_y,
+      .pixels = pixels,
+  };
+  return true;
+}
+
+// Calls 'fn' with each directory of the search path until it returns true
+static bool search_path(bool (*fn)(const char *dir, void *data), void *data) {
+  const char *path = getenv("XCURSOR_PATH");
+  if (path == NULL)
+    path = XCURSOR_PATH;
+
+  const char *home = getenv("HOME");
+  char dir[4096];
+
+  for (const char *p = path; *p != '\0';) {
+    const size_t len = strcspn(p, ":");
+    if (p[0] == '~' && home != NULL)
+      snprintf(dir, sizeof(dir), "%s%.*s", home, (int)len - 1, p + 1);
+    else
+      snprintf(dir, sizeof(dir), "%.*s", (int)len, p);
+
+    if (len > 0 && fn(dir, data))
+      return true;
+
+    p += len;
+    if (*p == ':')
+      p++;
+  }
+  return false;
+}
+
+struct lookup {
+  const char *theme;
+  const char *name;
+  int size;
+  int depth;
+  struct xcursor_image *image;
+};
+
+static bool load_from_theme(const struct lookup *l);
+
+static bool load_from_dir(const char *dir, void *data) {
+  const struct lookup *l = data;
+  char file[4096];
+  snprintf(file, sizeof(file), "%s/%s/cursors/%s", dir, l->theme, l->name);
+
+  FILE *f = fopen(file, "rb");
+  if (f == NULL)
+    return false;
+
+  const bool ok = read_image(f, l->image, l->size);
+  fclose(f);
+
+  if (!ok)
+    LOG_WARN("%s: not a valid cursor file", file);
+  else
+    LOG_DBG("%s: %dx%d", file, l->image->width, l->image->height);
+  return ok;
+}
+
+// Follows the Inherits= line of an index.theme
+static bool load_inherited(const char *dir, void *data) {
+  const struct lookup *l = data;
+  char file[4096];
+  snprintf(file, sizeof(file), "%s/%s/index.theme", dir, l->theme);
+
+  FILE *f = fopen(file, "r");
+  if (f == NULL)
+    return false;
+
+  bool found = false;
+  char line[1024];
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "Inherits", 8) != 0)
+      continue;
+
+    char *value = line + 8 + strspn(line + 8, " \t");
+    if (*value != '=')
+      continue;
+
+    char *save = NULL;
+    for (char *theme = strtok_r(value + 1, " \t,;\r\n", &save);
+         theme != NULL && !found;
+         theme = strtok_r(NULL, " \t,;\r\n", &save)) {
+      if (strcmp(theme, l->theme) == 0)
+        continue;
+
+      struct lookup parent = *l;
+      parent.theme = theme;
+      parent.depth++;
+      found = load_from_theme(&parent);
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+static bool load_from_theme(const struct lookup *l) {
+  if (l->depth > INHERIT_DEPTH)
+    return false;
+
+  return search_path(&load_from_dir, (void *)l) ||
+         search_path(&load_inherited, (void *)l);
+}
+
+bool xcursor_load(struct xcursor_image *image, const char *theme,
+                  const char *name, int size) {
+  if (theme == NULL)
+    theme = getenv("XCURSOR_THEME");
+
+  struct lookup l = {
+      .theme = theme != NULL ? theme : "default",
+      .name = name,
+      .size = size,
+      .image = image,
+  };
+  if (load_from_theme(&l))
+    return true;
+
+  if (strcmp(l.theme, "default") != 0) {
+    l.theme = "default";
+    if (load_from_theme(&l))
+      return true;
+  }
+  return false;
+}
+
+void xcursor_image_free(struct xcursor_image *image) {
+  free(image->pixels);
+  image->pixels = NULL;
+}
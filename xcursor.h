@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Just enough of an Xcursor theme loader to get the pixels of the user's
+ * pointer image. libwayland-cursor loads the same themes, but only hands
+ * out wl_buffers, and we need to draw the cursor into our own buffer.
+ */
+
+struct xcursor_image {
+  int width;
+  int height;
+  int hot_x;
+  int hot_y;
+  uint32_t *pixels; // premultiplied ARGB, width x height
+};
+
+/*
+ * The first frame of cursor 'name' in 'theme' (NULL for $XCURSOR_THEME),
+ * or an inherited theme, in the nominal size closest to 'size'. Themes are
+ * searched in $XCURSOR_PATH, like libXcursor does.
+ */
+bool xcursor_load(struct xcursor_image *image, const char *theme,
+                  const char *name, int size);
+void xcursor_image_free(struct xcursor_image *image);